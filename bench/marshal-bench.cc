@@ -0,0 +1,128 @@
+/* compares the scalar loops JACK modules used to move voltages between
+ * rack ports and lane frames with the ones they use now, from
+ * src/voltage-marshal.hh: with every port patched, and with only every
+ * other group of four, which the modules skip. prints nanoseconds per
+ * rack sample for each module shape. */
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "voltage-marshal.hh"
+
+using namespace rack;
+using namespace rack::engine;
+
+static const int SAMPLES = 1 << 22;
+
+// every channel patched, or every other group of four
+static const uint64_t ALL = ~uint64_t(0);
+static const uint64_t HALF = 0x0f0f0f0f0f0f0f0full;
+
+// keeps the compiler from throwing the work away
+static volatile float g_sink;
+
+typedef std::chrono::steady_clock clock_type;
+
+template <typename F>
+static double time_per_sample(F body) {
+   auto start = clock_type::now();
+   for (int i = 0; i < SAMPLES; i++) body(i);
+   auto end = clock_type::now();
+   return std::chrono::duration<double, std::nano>(end - start).count() / SAMPLES;
+}
+
+static void bench_mono(int channels) {
+   std::vector<Input> inputs(channels);
+   std::vector<Output> outputs(channels);
+   std::vector<float> samples(channels);
+   for (int i = 0; i < channels; i++) {
+      inputs[i].setChannels(1);
+      inputs[i].setVoltage(i * 0.1f);
+   }
+
+   double gather_scalar = time_per_sample([&](int) {
+      for (int i = 0; i < channels; i++)
+	 samples[i] = inputs[i].getVoltage() / 10.0f;
+      g_sink = samples[channels - 1];
+   });
+
+   auto gather = [&](uint64_t active) {
+      return time_per_sample([&](int) {
+	 gather_voltages(inputs.data(), samples.data(), channels, active);
+	 g_sink = samples[channels - 1];
+      });
+   };
+
+   double scatter_scalar = time_per_sample([&](int n) {
+      samples[0] = n;
+      for (int i = 0; i < channels; i++)
+	 outputs[i].setVoltage(samples[i] * 10.0f);
+      g_sink = outputs[channels - 1].getVoltage();
+   });
+
+   auto scatter = [&](uint64_t active) {
+      return time_per_sample([&](int n) {
+	 samples[0] = n;
+	 scatter_voltages(samples.data(), outputs.data(), channels, active);
+	 g_sink = outputs[channels - 1].getVoltage();
+      });
+   };
+
+   printf("mono %2d ports   rack->frame %6.2f ns scalar %6.2f ns all %6.2f ns half"
+	  "   frame->rack %6.2f ns scalar %6.2f ns all %6.2f ns half\n",
+	  channels, gather_scalar, gather(ALL), gather(HALF),
+	  scatter_scalar, scatter(ALL), scatter(HALF));
+}
+
+static void bench_poly() {
+   const int channels = PORT_MAX_CHANNELS;
+   Input input;
+   Output output;
+   float samples[PORT_MAX_CHANNELS];
+   input.setChannels(channels);
+   output.setChannels(channels);
+   for (int c = 0; c < channels; c++) input.setVoltage(c * 0.1f, c);
+
+   double gather_scalar = time_per_sample([&](int) {
+      for (int c = 0; c < channels; c++)
+	 samples[c] = input.getVoltage(c) / 10.0f;
+      g_sink = samples[channels - 1];
+   });
+
+   auto gather = [&](uint64_t active) {
+      return time_per_sample([&](int) {
+	 gather_poly_voltages(input, samples, channels, active);
+	 g_sink = samples[channels - 1];
+      });
+   };
+
+   double scatter_scalar = time_per_sample([&](int n) {
+      samples[0] = n;
+      for (int c = 0; c < channels; c++)
+	 output.setVoltage(samples[c] * 10.0f, c);
+      g_sink = output.getVoltage(channels - 1);
+   });
+
+   auto scatter = [&](uint64_t active) {
+      return time_per_sample([&](int n) {
+	 samples[0] = n;
+	 scatter_poly_voltages(samples, output, channels, active);
+	 g_sink = output.getVoltage(channels - 1);
+      });
+   };
+
+   printf("poly %2d voices  rack->frame %6.2f ns scalar %6.2f ns all %6.2f ns half"
+	  "   frame->rack %6.2f ns scalar %6.2f ns all %6.2f ns half\n",
+	  channels, gather_scalar, gather(ALL), gather(HALF),
+	  scatter_scalar, scatter(ALL), scatter(HALF));
+}
+
+int main() {
+   bench_mono(4);
+   bench_mono(8);
+   bench_mono(16);
+   bench_mono(64);
+   bench_poly();
+   return 0;
+}
@@ -0,0 +1,182 @@
+/* drives the transport the way rack's engine and jack's process
+ * callback would, but without either. a made up clock decides when the
+ * engine makes a sample and when jack wants a period, and both sides
+ * take turns on this one thread in the order the clock says. prints
+ * nanoseconds per frame for each side, how long periods took at the
+ * tail, and how many periods some module wasn't ready for, for a few
+ * patch sizes, period sizes and sample rates.
+ *
+ * takes the seconds of audio to run each case for; five by default.
+ * built with -Drt_check=true, fails if the jack side did anything it
+ * shouldn't have in a realtime thread. */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "jack-transport.hh"
+#include "rt-check.hh"
+
+static const jack_nframes_t MAX_PERIOD = 1024;
+
+// keeps the compiler from throwing the work away
+static volatile float g_sink;
+
+typedef std::chrono::steady_clock clock_type;
+
+static double nanoseconds(clock_type::time_point from, clock_type::time_point to) {
+   return std::chrono::duration<double, std::nano>(to - from).count();
+}
+
+// a module without rack ports; the engine side is a ramp and a sink
+struct bench_module: public jack_transport {
+   bench_module(jack_transport_hub& hub, size_t to_jack, size_t from_jack)
+      : jack_transport(hub, to_jack, from_jack) {}
+
+   // what the module's process would do for one rack sample
+   virtual void engine_step(int rack_rate, int jack_rate) = 0;
+};
+
+template <size_t TO_JACK, size_t FROM_JACK>
+struct bench_module_of: public bench_module {
+   jack_lanes<TO_JACK, FROM_JACK> lanes;
+
+   // stands in for the buffers jack hands out for each port
+   std::vector<jack_default_audio_sample_t> storage;
+   jack_default_audio_sample_t* buffers[TO_JACK + FROM_JACK];
+
+   float ramp;
+
+   bench_module_of(jack_transport_hub& hub)
+      : bench_module(hub, TO_JACK, FROM_JACK),
+	storage((TO_JACK + FROM_JACK) * MAX_PERIOD), ramp(0)
+   {
+      for (size_t i = 0; i < TO_JACK + FROM_JACK; i++) {
+	 buffers[i] = &storage[i * MAX_PERIOD];
+      }
+      globally_register();
+   }
+
+   ~bench_module_of() {
+      globally_unregister();
+   }
+
+   void engine_step(int rack_rate, int jack_rate) override {
+      lanes.step(*this, rack_rate, jack_rate,
+		 [](const float* samples) {
+		    g_sink = samples[0];
+		 },
+		 [this](float* samples) {
+		    for (int c = 0; c < (int)TO_JACK; c++) samples[c] = ramp;
+		    ramp = (ramp > 1.f) ? -1.f : ramp + 0.001f;
+		 });
+   }
+
+   void on_jack_period(jack_nframes_t nframes) override {
+      lanes.exchange(*this, buffers, nframes);
+   }
+
+   bool period_ready(jack_nframes_t nframes) override {
+      return lanes.ready(nframes);
+   }
+};
+
+// the shapes the plugin ships, in turn
+static bench_module* make_module(size_t i, jack_transport_hub& hub) {
+   switch (i % 4) {
+   case 0: return new bench_module_of<4, 4>(hub);
+   case 1: return new bench_module_of<8, 0>(hub);
+   case 2: return new bench_module_of<0, 8>(hub);
+   default: return new bench_module_of<16, 16>(hub);
+   }
+}
+
+// `sorted` must be sorted
+static double percentile(const std::vector<double>& sorted, double q) {
+   size_t i = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+   return sorted[i];
+}
+
+static void bench(size_t modules, jack_nframes_t period,
+		  int rack_rate, int jack_rate, double seconds)
+{
+   /* nothing is ever `running`, so a module which has run ahead only
+    * marks itself blocked rather than waiting for a period which this
+    * thread would have to deliver. the clock keeps the engine from
+    * getting far ahead instead. */
+   jack_transport_hub hub;
+   hub.buffersize = period;
+
+   std::vector<std::unique_ptr<bench_module>> patch;
+   for (size_t i = 0; i < modules; i++) {
+      patch.emplace_back(make_module(i, hub));
+   }
+
+   size_t periods = (size_t)(seconds * jack_rate / period);
+   std::vector<double> jack_times;
+   jack_times.reserve(periods);
+
+   double engine_total = 0;
+   double jack_total = 0;
+   uint64_t rack_frames = 0;
+   unsigned int missed = 0;
+
+   for (size_t p = 0; p < periods; p++) {
+      // the engine keeps one period in hand, like a real cushion would
+      uint64_t due = (uint64_t)(p + 2) * period * rack_rate / jack_rate;
+
+      auto start = clock_type::now();
+      for (; rack_frames < due; rack_frames++) {
+	 for (auto& module : patch) module->engine_step(rack_rate, jack_rate);
+      }
+      auto made = clock_type::now();
+
+      for (auto& module : patch) {
+	 if (!module->period_ready(period)) missed++;
+      }
+
+      auto asked = clock_type::now();
+      hub.run_period(period);
+      auto done = clock_type::now();
+
+      engine_total += nanoseconds(start, made);
+      jack_total += nanoseconds(asked, done);
+      jack_times.push_back(nanoseconds(asked, done) / 1000.0);
+   }
+
+   std::sort(jack_times.begin(), jack_times.end());
+
+   printf("%2zu modules %4u frames %5d->%5d Hz"
+	  "   engine %7.2f ns/frame   jack %7.2f ns/frame"
+	  "   period p50 %7.2f p99 %7.2f p99.9 %7.2f max %8.2f us"
+	  "   missed %u\n",
+	  modules, (unsigned)period, rack_rate, jack_rate,
+	  engine_total / rack_frames, jack_total / ((double)periods * period),
+	  percentile(jack_times, 0.5), percentile(jack_times, 0.99),
+	  percentile(jack_times, 0.999), jack_times.back(), missed);
+}
+
+int main(int argc, char** argv) {
+   double seconds = (argc > 1) ? atof(argv[1]) : 5.0;
+   if (seconds <= 0) seconds = 5.0;
+
+   static const size_t patch_sizes[] = {1, 4, 16};
+   static const jack_nframes_t periods[] = {64, 256, MAX_PERIOD};
+
+   for (size_t modules : patch_sizes) {
+      for (jack_nframes_t period : periods) {
+	 bench(modules, period, 48000, 48000, seconds);
+	 bench(modules, period, 44100, 48000, seconds);
+      }
+   }
+
+   unsigned long violations = rt_violations();
+   if (violations) {
+      printf("%lu realtime safety violations\n", violations);
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+/* follows a clock which ticks every so many frames, e.g. jack's once a
+ * period, from when each tick is seen on ours (monotonic_ns), and fits
+ * a line through the last couple of minutes of them:
+ *
+ *   drift    how much faster than nominal the clock runs, in ppm
+ *   jitter   how far ticks land from that line, rms
+ *
+ * the fit forgets old ticks gradually rather than keeping them, so it
+ * is a handful of running sums. a tick over a second out means the
+ * clock stopped, and the fit starts over. for a clock which `may_skip`
+ * ticks, as jack's does when it xruns, a tick one or more whole ticks
+ * late is taken as some having been skipped, and counted as a resync.
+ * one thread ticks; anybody may read. */
+struct clock_estimator {
+   // how many seconds of ticks the fit remembers, and needs to be worth reading
+   static constexpr double WINDOW_SECONDS = 120.0;
+   static constexpr double SETTLE_SECONDS = 10.0;
+
+   std::atomic<float> drift_ppm;
+   std::atomic<float> jitter_us;
+   std::atomic<bool> settled;
+   std::atomic<unsigned long> resyncs;
+
+   clock_estimator(bool may_skip)
+      : drift_ppm(0.f), jitter_us(0.f), settled(false), resyncs(0),
+	m_may_skip(may_skip), m_nominal(0), m_origin(0), m_expected(0), m_ticks(0),
+	m_mean_x(0), m_mean_y(0), m_var_x(0), m_cov_xy(0), m_error_sq(0) {}
+
+   /* `nominal` is how many seconds a tick should take; a tick with a
+    * different nominal than the last starts everything over */
+   void tick(uint64_t now_ns, double nominal) {
+      if (nominal != m_nominal) {
+	 restart(now_ns, nominal);
+	 return;
+      }
+
+      // seconds since the first tick, as seen by us and by the clock
+      double y = (now_ns - m_origin) / 1e9;
+      m_expected += nominal;
+
+      double slope = (m_ticks > 2 && m_var_x > 0) ? m_cov_xy / m_var_x : 1.0;
+      double error = y - (m_mean_y + slope * (m_expected - m_mean_x));
+      if (error > 1.0 || error < -1.0) {
+	 restart(now_ns, nominal);
+	 return;
+      }
+
+      double skipped = m_may_skip ? std::floor(error / (nominal * slope) + 0.5) : 0;
+      if (skipped >= 1) {
+	 m_expected += skipped * nominal;
+	 error -= skipped * nominal * slope;
+	 resyncs.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      // a plain average to begin with, so it settles quickly
+      m_ticks++;
+      double alpha = std::max(1.0 / m_ticks, nominal / WINDOW_SECONDS);
+
+      double dx = m_expected - m_mean_x;
+      double dy = y - m_mean_y;
+      m_mean_x += alpha * dx;
+      m_mean_y += alpha * dy;
+      m_var_x = (1 - alpha) * (m_var_x + alpha * dx * dx);
+      m_cov_xy = (1 - alpha) * (m_cov_xy + alpha * dx * dy);
+      if (m_ticks > 2) {
+	 m_error_sq += (error * error - m_error_sq) * std::max(1.0 / m_ticks, 1.0 / 64);
+      }
+
+      if (m_var_x > 0 && m_cov_xy > 0) {
+	 // the clock's seconds per our seconds, less one
+	 drift_ppm.store(float((m_var_x / m_cov_xy - 1) * 1e6), std::memory_order_relaxed);
+      }
+      jitter_us.store(float(std::sqrt(m_error_sq) * 1e6), std::memory_order_relaxed);
+      settled.store(m_expected > SETTLE_SECONDS, std::memory_order_relaxed);
+   }
+
+   // the clock stopped being worth following, e.g. while freewheeling
+   void reset() {
+      m_nominal = 0;
+      settled.store(false, std::memory_order_relaxed);
+   }
+
+private:
+   bool m_may_skip;
+
+   // ticking thread only; in seconds, or ns for m_origin
+   double m_nominal;
+   uint64_t m_origin;
+   double m_expected;
+   unsigned long m_ticks;
+   double m_mean_x, m_mean_y, m_var_x, m_cov_xy;
+   double m_error_sq;
+
+   void restart(uint64_t now_ns, double nominal) {
+      m_nominal = nominal;
+      m_origin = now_ns;
+      m_expected = 0;
+      m_ticks = 1;
+      m_mean_x = m_mean_y = m_var_x = m_cov_xy = m_error_sq = 0;
+      settled.store(false, std::memory_order_relaxed);
+   }
+};
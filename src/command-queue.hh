@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+/* many threads push, one thread takes everything at once. pushing never
+ * waits on anyone, so it is safe to do while the consumer is stuck in a
+ * slow call. each push allocates, so don't push from the realtime
+ * thread. */
+template <typename T>
+class command_queue {
+  struct node {
+    T value;
+    node* next;
+  };
+
+  std::atomic<node*> m_head;
+
+public:
+  command_queue() : m_head(nullptr) {}
+
+  ~command_queue() {
+    drain([](T&) {});
+  }
+
+  void push(T value) {
+    node* n = new node{std::move(value), m_head.load(std::memory_order_relaxed)};
+    while (!m_head.compare_exchange_weak
+	   (n->next, n, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  bool empty() const {
+    return m_head.load(std::memory_order_relaxed) == nullptr;
+  }
+
+  // consumer only; hands `f` everything pushed so far, oldest first
+  template <typename F>
+  void drain(F f) {
+    node* n = m_head.exchange(nullptr, std::memory_order_acquire);
+
+    // pushes stack up newest first
+    node* oldest = nullptr;
+    while (n) {
+      node* next = n->next;
+      n->next = oldest;
+      oldest = n;
+      n = next;
+    }
+
+    while (oldest) {
+      node* next = oldest->next;
+      f(oldest->value);
+      delete oldest;
+      oldest = next;
+    }
+  }
+};
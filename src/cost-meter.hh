@@ -0,0 +1,33 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// a clock for timing things with, not for telling the time
+inline uint64_t monotonic_ns() {
+   return std::chrono::duration_cast<std::chrono::nanoseconds>
+      (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* how long something has usually been taking, and the worst of it
+ * lately. one thread adds to it; anybody may read it. */
+struct cost_meter {
+   std::atomic<float> average_ns;
+   std::atomic<float> peak_ns;
+
+   cost_meter() : average_ns(0.f), peak_ns(0.f) {}
+
+   void add(float ns) {
+      float average = average_ns.load(std::memory_order_relaxed);
+      average_ns.store(average + (ns - average) / 32.f, std::memory_order_relaxed);
+
+      // a peak fades by half over three hundred and some goes
+      float peak = peak_ns.load(std::memory_order_relaxed) * 0.998f;
+      peak_ns.store(std::max(peak, ns), std::memory_order_relaxed);
+   }
+
+   float average() const { return average_ns.load(std::memory_order_relaxed); }
+   float peak() const { return peak_ns.load(std::memory_order_relaxed); }
+};
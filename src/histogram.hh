@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/* how often something fell in each of BUCKETS fixed buckets; what each
+ * bucket means is up to whoever picks them. adding is a single atomic
+ * increment, so it is fine from the realtime thread; anybody may read
+ * or reset it at any time. a reset racing an add may keep that add. */
+template <size_t BUCKETS>
+struct histogram {
+   std::atomic<uint32_t> counts[BUCKETS];
+
+   histogram() { reset(); }
+
+   // anything past the last bucket goes in it
+   void add(size_t bucket) {
+      if (bucket >= BUCKETS) bucket = BUCKETS - 1;
+      counts[bucket].fetch_add(1, std::memory_order_relaxed);
+   }
+
+   uint32_t operator[](size_t bucket) const {
+      return counts[bucket].load(std::memory_order_relaxed);
+   }
+
+   uint64_t total() const {
+      uint64_t sum = 0;
+      for (size_t i = 0; i < BUCKETS; i++) sum += (*this)[i];
+      return sum;
+   }
+
+   void reset() {
+      for (size_t i = 0; i < BUCKETS; i++) {
+	 counts[i].store(0, std::memory_order_relaxed);
+      }
+   }
+};
@@ -1,7 +1,9 @@
 #include "jack-audio-module-widget.hh"
 #include "jack-audio-module.hh"
-#include "hashids.hh"
 #include "components.hh"
+#include "memory-lock.hh"
+
+#include <cerrno>
 
 namespace rack {
    extern std::shared_ptr<Font> gGuiFont;
@@ -27,6 +29,14 @@ struct JackPortLedTextField : public LedDisplayTextField {
       // This needs to be done here, but its commented out because the rest of the code doesn't work
       //std::shared_ptr<Font> font = APP->window->loadFont(asset::plugin(::plugin, "res/3270Medium.ttf"));
 
+      // lit while the port is connected to something in jack
+      if (master->port_connected(managed_port)) {
+	 nvgBeginPath(args.vg);
+	 nvgCircle(args.vg, box.size.x - 5.0, 5.0, 2.0);
+	 nvgFillColor(args.vg, color);
+	 nvgFill(args.vg);
+      }
+
    	nvgResetScissor(args.vg);
 
    }
@@ -39,53 +49,173 @@ struct JackPortLedTextField : public LedDisplayTextField {
    }
 };
 
+// stands in for an svg panel on modules too wide to have one drawn
+struct jack_generated_panel : public Widget {
+   size_t columns;
+
+   void draw(const DrawArgs &args) override {
+      nvgBeginPath(args.vg);
+      nvgRect(args.vg, 0, 0, box.size.x, box.size.y);
+      nvgFillPaint(args.vg, nvgLinearGradient
+		   (args.vg, 0, 0, 0, box.size.y,
+		    nvgRGB(0x40, 0x42, 0x45), nvgRGB(0x2e, 0x2f, 0x30)));
+      nvgFill(args.vg);
+
+      // a divider between each column of ports
+      for (size_t i = 1; i < columns; i++) {
+	 float x = box.size.x * i / columns;
+	 nvgBeginPath(args.vg);
+	 nvgMoveTo(args.vg, x, RACK_GRID_WIDTH);
+	 nvgLineTo(args.vg, x, box.size.y - RACK_GRID_WIDTH);
+	 nvgStrokeColor(args.vg, nvgRGB(0x17, 0x17, 0x17));
+	 nvgStrokeWidth(args.vg, 1.0);
+	 nvgStroke(args.vg);
+      }
+   }
+};
+
+/* a thin pair of bars along the bottom of the panel: how much of each
+ * jack period this module takes on top, how much of the engine's time
+ * per sample underneath. numbers are in the diagnostics menu. */
+struct jack_load_bar : public Widget {
+   jack_audio_module_base* module = NULL;
+
+   static void draw_share(NVGcontext* vg, float x, float y, float width, float height,
+			  float share)
+   {
+      share = clamp(share, 0.f, 1.f);
+      if (share <= 0.f) return;
+
+      nvgBeginPath(vg);
+      nvgRect(vg, x, y, std::max(width * share, 1.f), height);
+      // amber past a quarter, red past half
+      nvgFillColor(vg, share > 0.5f ? nvgRGB(0xe7, 0x4c, 0x3c)
+		   : share > 0.25f ? nvgRGB(0xf3, 0x9c, 0x12)
+		   : nvgRGB(0x2e, 0xcc, 0x71));
+      nvgFill(vg);
+   }
+
+   void draw(const DrawArgs &args) override {
+      if (!module) return;
+
+      nvgBeginPath(args.vg);
+      nvgRect(args.vg, 0, 0, box.size.x, box.size.y);
+      nvgFillColor(args.vg, nvgRGBA(20, 20, 20, 0xcc));
+      nvgFill(args.vg);
+
+      float half = box.size.y / 2;
+      draw_share(args.vg, 0, 0, box.size.x, half,
+		 module->hub.period_share(module->jack_cost.average()));
+      draw_share(args.vg, 0, half, box.size.x, half,
+		 module->engine_cost.average() * APP->engine->getSampleRate() / 1e9f);
+   }
+};
+
+// ports per column, and how far apart the columns are; matches the
+// spacing of our svg panels
+#define PORT_ROWS 8
+#define COLUMN_HP 10
+
 jack_audio_module_widget_base::jack_audio_module_widget_base
-(jack_audio_module_base* module):
+(jack_audio_module_base* module, size_t columns, const char* panel):
    ModuleWidget(module)
 {
-}
+   if (panel) {
+      setPanel(APP->window->loadSvg(asset::plugin(::plugin, panel)));
+   } else {
+      auto generated = createWidget<jack_generated_panel>(Vec(0, 0));
+      generated->columns = columns;
+      generated->box.size = Vec(columns * COLUMN_HP * RACK_GRID_WIDTH,
+				RACK_GRID_HEIGHT);
+      setPanel(generated);
+   }
 
-#define def_port_label_out(id, x, y) {					\
-   port_names[id] = createWidget<JackPortLedTextField>(mm2px(Vec(x, y))); \
-   auto self = reinterpret_cast<JackPortLedTextField*>(port_names[id]);	\
-   self->managed_port = id;						\
-   self->master = this;							\
-   self->box.size = mm2px(Vec(35.0, 10.753));				\
-   self->color = nvgRGB(0x02,0x7b,0x35);           \
-   self->fontPath = asset::system("res/fonts/Nunito-Bold.ttf");           \
-   addChild(self);							\
+   addChild(createWidget<ThemedScrew>
+	    (Vec(RACK_GRID_WIDTH, 0)));
+   addChild(createWidget<ThemedScrew>
+	    (Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
+   addChild(createWidget<ThemedScrew>
+	    (Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+   addChild(createWidget<ThemedScrew>
+	    (Vec(box.size.x - 2 * RACK_GRID_WIDTH,
+		 RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+
+   // between the bottom screws
+   auto load = createWidget<jack_load_bar>
+      (Vec(2 * RACK_GRID_WIDTH + 5, RACK_GRID_HEIGHT - RACK_GRID_WIDTH + 5));
+   load->module = module;
+   load->box.size = Vec(box.size.x - 4 * RACK_GRID_WIDTH - 10, 4);
+   addChild(load);
 }
 
-#define def_port_label_in(id, x, y) {             \
-   port_names[id] = createWidget<JackPortLedTextField>(mm2px(Vec(x, y))); \
-   auto self = reinterpret_cast<JackPortLedTextField*>(port_names[id]); \
-   self->managed_port = id;                  \
-   self->master = this;                   \
-   self->box.size = mm2px(Vec(35.0, 10.753));            \
-   self->color = nvgRGB(0x8e,0x44, 0xad);           \
-   self->fontPath = asset::system("res/fonts/Nunito-Bold.ttf");           \
-   addChild(self);                     \
+jack_audio_module_widget_base::jack_audio_module_widget_base
+(jack_audio_module_base* module, size_t to_jack, size_t from_jack,
+ const char* panel):
+   jack_audio_module_widget_base
+   (module, (to_jack + from_jack + PORT_ROWS - 1) / PORT_ROWS, panel)
+{
+   /* modules with nothing but rack inputs keep their jacks on the left
+    * edge, like RackJack8; everything else has them on the right. */
+   bool jacks_left = (from_jack == 0);
+
+   size_t ports = to_jack + from_jack;
+   for (size_t i = 0; i < ports; i++) {
+      if (i < to_jack) {
+	 add_port(i, true, i, jacks_left);
+      } else {
+	 add_port(i, false, i - to_jack, jacks_left);
+      }
+   }
+
+   assume_default_port_names();
 }
 
-#define def_input(self, id, x, y) addInput				\
-   (createInput<DavidLTPort>						\
-    (mm2px(Vec(x, y)),							\
-     module, self::AUDIO_INPUT + id));
+void jack_audio_module_widget_base::add_port
+(size_t slot, bool to_jack, int id, bool jacks_left)
+{
+   float jack_x = jacks_left ? 2.7069211 : 40.069211;
+   float label_x = jacks_left ? 12.7069211 : 2.7069211;
+
+   // one HP is 5.08mm
+   float column = (slot / PORT_ROWS) * COLUMN_HP * 5.08;
+   float row = (slot % PORT_ROWS) * 13.0;
+
+   if (to_jack) {
+      addInput(createInput<DavidLTPort>
+	       (mm2px(Vec(column + jack_x, 11.730807 + row)),
+		module, id));
+   } else {
+      addOutput(createOutput<DavidLTPort>
+		(mm2px(Vec(column + jack_x, 11.730807 + row)),
+		 module, id));
+   }
+
+   auto label = createWidget<JackPortLedTextField>
+      (mm2px(Vec(column + label_x, 10.530807 + row)));
+   label->managed_port = port_names.size();
+   label->master = this;
+   label->box.size = mm2px(Vec(35.0, 10.753));
+   // inbound to jack is purple, outbound from jack is green
+   label->color = to_jack
+      ? nvgRGB(0x8e, 0x44, 0xad)
+      : nvgRGB(0x02, 0x7b, 0x35);
+   label->fontPath = asset::system("res/fonts/Nunito-Bold.ttf");
+   port_names.push_back(label);
+   addChild(label);
+}
 
-#define def_output(self, id, x, y) addOutput				\
-   (createOutput<DavidLTPort>						\
-    (mm2px(Vec(x, y)),							\
-     module, self::AUDIO_OUTPUT + id));
+#undef PORT_ROWS
+#undef COLUMN_HP
 
 void jack_audio_module_widget_base::assume_default_port_names() {
    static const size_t buffer_size = 128;
    char port_name[buffer_size];
-   hashidsxx::Hashids hash(g_hashid_salt);
-   std::string id = hash.encode(reinterpret_cast<size_t>(module));
-   auto mod = reinterpret_cast<JackAudioModule*>(module);
+   auto mod = dynamic_cast<jack_audio_module_base*>(module);
+   // the module browser shows us without a module behind us
+   std::string id = mod ? mod->identity : "jack";
 
 
-   for (int i = 0; i < JACK_PORTS; i++) {
+   for (size_t i = 0; i < port_names.size(); i++) {
       bool done = false;
       if (mod) {
          if (!mod->port_names[i].empty()) {
@@ -98,170 +228,333 @@ void jack_audio_module_widget_base::assume_default_port_names() {
          }
       }
       if (!done) {
-         snprintf(reinterpret_cast<char*>(&port_name),
-          buffer_size,
-          "%s:%d", id.c_str(), i);
          // XXX using setText here would cause crashes because it would try to tell
-         port_names[i]->text = std::string(port_name);
+         port_names[i]->text = jack_audio_module_base::default_port_name(id, i);
       }
    }
 }
 
-JackAudioModuleWidget::JackAudioModuleWidget(JackAudioModule* module)
-   : jack_audio_module_widget_base(module)
-{
-   setPanel(APP->window->loadSvg(asset::plugin(::plugin, "res/JackAudioB.svg")));
-
-   addChild(createWidget<ThemedScrew>
-	    (Vec(RACK_GRID_WIDTH, 0)));
-   addChild(createWidget<ThemedScrew>
-	    (Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
-   addChild(createWidget<ThemedScrew>
-	    (Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
-   addChild(createWidget<ThemedScrew>
-	    (Vec(box.size.x - 2 * RACK_GRID_WIDTH,
-		 RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
-
-   /*[[[cog
-     for i in range(8):
-       if i < 4:
-         cog.outl('def_input(JackAudioModule, {}, 3.706, {});'.format(i, 10.530807 + (i * 13)))
-       else:
-         cog.outl('def_output(JackAudioModule, {}, 3.706, {});'.format(i % 4, 10.530807 + (i * 13)))
-       cog.outl('def_port_label({}, 13.7069211, {});'.format(i, 8.530807 + (i * 13)))
-     ]]] */
-   def_input(JackAudioModule, 0, 40.069211, 11.730807);
-   def_port_label_in(0, 2.7069211, 10.530807);
-   def_input(JackAudioModule, 1, 40.069211, 24.730807);
-   def_port_label_in(1, 2.7069211, 23.530807);
-   def_input(JackAudioModule, 2, 40.069211, 37.730806999999996);
-   def_port_label_in(2, 2.7069211, 36.530806999999996);
-   def_input(JackAudioModule, 3, 40.069211, 50.730806999999996);
-   def_port_label_in(3, 2.7069211, 49.530806999999996);
-   def_output(JackAudioModule, 0, 40.069211, 63.730806999999996);
-   def_port_label_out(4, 2.7069211, 62.530806999999996);
-   def_output(JackAudioModule, 1, 40.069211, 76.730807);
-   def_port_label_out(5, 2.7069211, 75.530807);
-   def_output(JackAudioModule, 2, 40.069211, 89.730807);
-   def_port_label_out(6, 2.7069211, 88.530807);
-   def_output(JackAudioModule, 3, 40.069211, 102.730807);
-   def_port_label_out(7, 2.7069211, 101.530807);
-   //[[[end]]]
-
+void jack_audio_module_widget_base::on_port_names_applied() {
    assume_default_port_names();
 }
 
-jack_audio_out8_module_widget::jack_audio_out8_module_widget
-(jack_audio_out8_module* module)
-   : jack_audio_module_widget_base(module)
+JackAudioModuleWidget::JackAudioModuleWidget(jack_audio_module<4, 4>* module)
+   : jack_audio_module_widget_base(module, 4, 4, "res/JackAudioB.svg")
 {
-   setPanel(APP->window->loadSvg(asset::plugin(::plugin, "res/JackAudioB-8out.svg")));
-
-   addChild(createWidget<ThemedScrew>
-	    (Vec(RACK_GRID_WIDTH, 0)));
-   addChild(createWidget<ThemedScrew>
-	    (Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
-   addChild(createWidget<ThemedScrew>
-	    (Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
-   addChild(createWidget<ThemedScrew>
-	    (Vec(box.size.x - 2 * RACK_GRID_WIDTH,
-		 RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
-
-   /*[[[cog
-     for i in range(8):
-       cog.outl('def_input(jack_audio_out8_module, {}, 3.7069211, {});'.format(i, 10.530807 + (13 * i)))
-       cog.outl('def_port_label({}, 13.7069211, {});'.format(i, 8.530807 + (i * 13)))
-     ]]] */
-   def_input(jack_audio_out8_module, 0, 2.7069211, 11.730807);
-   def_port_label_in(0, 12.7069211, 10.530807);
-   def_input(jack_audio_out8_module, 1, 2.7069211, 24.730807);
-   def_port_label_in(1, 12.7069211, 23.530807);
-   def_input(jack_audio_out8_module, 2, 2.7069211, 37.730806999999996);
-   def_port_label_in(2, 12.7069211, 36.530806999999996);
-   def_input(jack_audio_out8_module, 3, 2.7069211, 49.730806999999996);
-   def_port_label_in(3, 12.7069211, 49.530806999999996);
-   def_input(jack_audio_out8_module, 4, 2.7069211, 63.730806999999996);
-   def_port_label_in(4, 12.7069211, 62.530806999999996);
-   def_input(jack_audio_out8_module, 5, 2.7069211, 76.730807);
-   def_port_label_in(5, 12.7069211, 75.530807);
-   def_input(jack_audio_out8_module, 6, 2.7069211, 89.730807);
-   def_port_label_in(6, 12.7069211, 88.530807);
-   def_input(jack_audio_out8_module, 7, 2.7069211, 102.730807);
-   def_port_label_in(7, 12.7069211, 101.530807);
-   //[[[end]]]
+}
 
-   assume_default_port_names();
+jack_audio_out8_module_widget::jack_audio_out8_module_widget
+(jack_audio_module<8, 0>* module)
+   : jack_audio_module_widget_base(module, 8, 0, "res/JackAudioB-8out.svg")
+{
 }
 
 jack_audio_in8_module_widget::jack_audio_in8_module_widget
-(jack_audio_in8_module* module)
-   : jack_audio_module_widget_base(module)
+(jack_audio_module<0, 8>* module)
+   : jack_audio_module_widget_base(module, 0, 8, "res/JackAudioB-8in.svg")
 {
-   setPanel(APP->window->loadSvg(asset::plugin(::plugin, "res/JackAudioB-8in.svg")));
+}
 
-   addChild(createWidget<ThemedScrew>
-	    (Vec(RACK_GRID_WIDTH, 0)));
-   addChild(createWidget<ThemedScrew>
-	    (Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
-   addChild(createWidget<ThemedScrew>
-	    (Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
-   addChild(createWidget<ThemedScrew>
-	    (Vec(box.size.x - 2 * RACK_GRID_WIDTH,
-		 RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+jack_audio_poly_module_widget::jack_audio_poly_module_widget
+(jack_audio_poly_module* module)
+   : jack_audio_module_widget_base(module, 1, NULL)
+{
+   add_port(0, true, jack_audio_poly_module::POLY_INPUT, false);
+   add_port(1, false, jack_audio_poly_module::POLY_OUTPUT, false);
+
+   assume_default_port_names();
+}
 
-   /*[[[cog
-     for i in range(8):
-       cog.outl('def_output(jack_audio_in8_module, {}, 3.7069211, {});'.format(i, 10.530807 + (13 * i)))
-       cog.outl('def_port_label({}, 13.7069211, {});'.format(i, 8.530807 + (i * 13)))
-       ]]] */
-   def_output(jack_audio_in8_module, 0, 40.069211, 11.730807);
-   def_port_label_out(0, 2.7069211, 10.530807);
-   def_output(jack_audio_in8_module, 1, 40.069211, 24.730807);
-   def_port_label_out(1, 2.7069211, 23.530807);
-   def_output(jack_audio_in8_module, 2, 40.069211, 37.730806999999996);
-   def_port_label_out(2, 2.7069211, 36.530806999999996);
-   def_output(jack_audio_in8_module, 3, 40.069211, 49.730806999999996);
-   def_port_label_out(3, 2.7069211, 49.530806999999996);
-   def_output(jack_audio_in8_module, 4, 40.069211, 63.730806999999996);
-   def_port_label_out(4, 2.7069211, 62.530806999999996);
-   def_output(jack_audio_in8_module, 5, 40.069211, 76.730807);
-   def_port_label_out(5, 2.7069211, 75.530807);
-   def_output(jack_audio_in8_module, 6, 40.069211, 89.730807);
-   def_port_label_out(6, 2.7069211, 88.530807);
-   def_output(jack_audio_in8_module, 7, 40.069211, 102.730807);
-   def_port_label_out(7, 2.7069211, 101.530807);
-   //[[[end]]]
+void jack_audio_poly_module_widget::assume_default_port_names() {
+   static const size_t buffer_size = 128;
+   char port_name[buffer_size];
+   auto mod = dynamic_cast<jack_audio_poly_module*>(module);
+   std::string id = mod ? mod->identity : "jack";
+
+   for (size_t i = 0; i < port_names.size(); i++) {
+      size_t first_port = i * jack_audio_poly_module::VOICES;
+      if (mod && !mod->poly_names[i].empty()) {
+	 snprintf(port_name, buffer_size, "%s", mod->poly_names[i].c_str());
+      } else if (mod && !mod->port_names[first_port].empty()) {
+	 snprintf(port_name, buffer_size, "%s", mod->port_names[first_port].c_str());
+      } else {
+	 snprintf(port_name, buffer_size, "%s",
+		  jack_audio_module_base::default_port_name(id, first_port).c_str());
+      }
+      // XXX using setText here would cause crashes because it would try to tell
+      port_names[i]->text = std::string(port_name);
+   }
+}
 
+/* a cable is shown by its first voice's name, less the ":1" it was
+ * given; if the client had to number that, the number shows too */
+void jack_audio_poly_module_widget::on_port_names_applied() {
+   auto mod = dynamic_cast<jack_audio_poly_module*>(module);
+   if (mod) {
+      for (size_t i = 0; i < port_names.size(); i++) {
+	 std::string name = mod->port_names[i * jack_audio_poly_module::VOICES];
+	 if (name.size() > 2 && name.compare(name.size() - 2, 2, ":1") == 0) {
+	    name.resize(name.size() - 2);
+	 }
+	 mod->poly_names[i] = name;
+      }
+   }
    assume_default_port_names();
 }
 
-#undef def_port_label
-#undef def_input
-#undef def_output
+bool jack_audio_poly_module_widget::port_connected(int cable) {
+   for (size_t c = 0; c < jack_audio_poly_module::VOICES; c++) {
+      if (jack_audio_module_widget_base::port_connected
+	  (cable * jack_audio_poly_module::VOICES + c))
+      {
+	 return true;
+      }
+   }
+   return false;
+}
+
+void jack_audio_poly_module_widget::on_port_renamed(int cable, const std::string& name) {
+   auto module = dynamic_cast<jack_audio_poly_module*>(this->module);
+   if (!module) return;
+   if (cable < 0 || cable > 1) return;
+   if (name == module->poly_names[cable]) return;
+
+   // every voice on the cable gets a port named after it
+   static const size_t buffer_size = 128;
+   char port_name[buffer_size];
+   for (size_t c = 0; c < jack_audio_poly_module::VOICES; c++) {
+      snprintf(port_name, buffer_size, "%s:%d", name.c_str(), (int)c + 1);
+      jack_audio_module_widget_base::on_port_renamed
+	 (cable * jack_audio_poly_module::VOICES + c, port_name);
+   }
+   module->poly_names[cable] = name;
+}
 
 jack_audio_module_widget_base::~jack_audio_module_widget_base() {}
 JackAudioModuleWidget::~JackAudioModuleWidget() {}
 jack_audio_out8_module_widget::~jack_audio_out8_module_widget() {}
 jack_audio_in8_module_widget::~jack_audio_in8_module_widget() {}
 
+bool jack_audio_module_widget_base::port_connected(int port) {
+   auto module = dynamic_cast<jack_audio_module_base*>(this->module);
+   if (!module) return false;
+   if (port < 0 || port >= (int)module->jack_ports()) return false;
+   return module->jport[port].connected();
+}
+
 void jack_audio_module_widget_base::on_port_renamed(int port, const std::string& name) {
-   if (port < 0 || port > JACK_PORTS) return;
-   if (!g_jack_client.alive()) return;
-   auto module = reinterpret_cast<JackAudioModule*>(this->module);
+   auto module = dynamic_cast<jack_audio_module_base*>(this->module);
    if (!module) return;
+   if (port < 0 || port >= (int)module->jack_ports()) return;
 
    // Port name might already be set now we use deselect events
    if (name == module->port_names[port]) return;
 
-   // XXX port names must be unique per client; using a non-unique name here
-   // doesn't appear to "fail" but you do get a port with a blank name.
-   int error = module->jport[port].rename(name);
+   /* port names must be unique per client; the client numbers a name
+    * that's already taken, e.g. reverb-2-out, and step() shows us what
+    * it went with once it has */
+   int error = module->rename_port(port, name);
    if (error != 0) {
      // warning was broken in 0.6->1.0
      DEBUG("Changing port name failed: %s, %d", name.c_str(), error);
-     //port_names[port]->setText(std::string(jack_port_short_name(module->jport[port])));
    }
-   module->port_names[port] = name;
+}
+
+void jack_audio_module_widget_base::step() {
+   auto mod = dynamic_cast<jack_audio_module_base*>(module);
+   if (mod && mod->refresh_port_names()) on_port_names_applied();
+   ModuleWidget::step();
+}
+
+// `ns` of work per `per`, and the `share` of the time available it takes
+static std::string time_and_share(float ns, float share, const char* per) {
+   if (ns >= 1000.f) {
+      return string::f("%.1f µs/%s (%.1f%%)", ns / 1000.f, per, share * 100.f);
+   }
+   return string::f("%.0f ns/%s (%.1f%%)", ns, per, share * 100.f);
+}
+
+static std::string microseconds(float us) {
+   return us >= 1000.f ? string::f("%g ms", us / 1000.f) : string::f("%g µs", us);
+}
+
+/* a line for every bucket anything fell in, with how much of the total
+ * it is and a bar to make the shape of it easier to see */
+template <size_t N, typename L>
+static void append_histogram(Menu* menu, const histogram<N>& h, L label) {
+   uint64_t total = h.total();
+   if (total == 0) {
+      menu->addChild(createMenuLabel("Nothing yet"));
+      return;
+   }
+
+   for (size_t i = 0; i < N; i++) {
+      uint32_t count = h[i];
+      if (count == 0) continue;
+
+      float share = float(count) / total;
+      menu->addChild(createMenuLabel
+		     (string::f("%s: %u (%.1f%%) ", label(i).c_str(), count, share * 100.f)
+		      + std::string(std::max(1, int(share * 20.f)), '#')));
+   }
+}
+
+static void append_fill_histogram(Menu* menu, jack_audio_module_base* module) {
+   append_histogram(menu, module->fill_histogram, [](size_t i) {
+      if (i == jack_transport::FILL_BUCKETS - 1) {
+	 return string::f("%g periods and up", jack_transport::fill_bucket_start(i));
+      }
+      return string::f("%g to %g periods", jack_transport::fill_bucket_start(i),
+		       jack_transport::fill_bucket_start(i + 1));
+   });
+}
+
+static void append_stall_histogram(Menu* menu, jack_audio_module_base* module) {
+   append_histogram(menu, module->stall_histogram, [](size_t i) {
+      if (i == 0) return std::string("under 1 µs");
+      if (i == jack_transport::STALL_BUCKETS - 1) {
+	 return microseconds(jack_transport::stall_bucket_start(i)) + " and up";
+      }
+      return microseconds(jack_transport::stall_bucket_start(i)) + " to "
+	 + microseconds(jack_transport::stall_bucket_start(i + 1));
+   });
+}
+
+// drift and jitter, once there's been long enough to tell
+static std::string clock_reading(const clock_estimator& clock) {
+   if (!clock.settled) return "settling...";
+   return string::f("%+.1f ppm, jitter %s", clock.drift_ppm.load(),
+		    microseconds(std::round(clock.jitter_us.load())).c_str());
+}
+
+/* what we know about how jack and its thread are doing, and what this
+ * module costs; `module` is NULL in the module browser */
+static void append_diagnostics(Menu* menu, jack_audio_module_base* module) {
+   const char* state = !g_jack_client.alive() ? "not connected"
+      : g_jack_client.freewheeling() ? "freewheeling"
+      : g_jack_client.active() ? "running"
+      : "starting";
+   menu->addChild(createMenuLabel(string::f("JACK: %s", state)));
+
+   menu->addChild(new MenuSeparator);
+   menu->addChild(createMenuLabel("Load"));
+   float cpu_load = g_jack_client.cpu_load();
+   if (cpu_load >= 0.f) {
+      menu->addChild(createMenuLabel(string::f("JACK DSP load: %.1f%%", cpu_load)));
+   }
+   menu->addChild(createMenuLabel
+		  ("Every module: " + time_and_share
+		   (g_transport.period_cost.average(),
+		    g_transport.period_share(g_transport.period_cost.average()), "period")));
+   menu->addChild(createMenuLabel
+		  (string::f("Every module, peak: %.1f%%",
+			     g_transport.period_share(g_transport.period_cost.peak()) * 100.f)));
+   if (module) {
+      float rack_rate = APP->engine->getSampleRate();
+      menu->addChild(createMenuLabel
+		     ("This module, JACK side: " + time_and_share
+		      (module->jack_cost.average(),
+		       g_transport.period_share(module->jack_cost.average()), "period")));
+      menu->addChild(createMenuLabel
+		     ("This module, engine side: " + time_and_share
+		      (module->engine_cost.average(),
+		       module->engine_cost.average() * rack_rate / 1e9f, "sample")));
+
+      menu->addChild(new MenuSeparator);
+      menu->addChild(createMenuLabel
+		     (string::f("Underruns: %lu", module->underruns.load())));
+      menu->addChild(createSubmenuItem
+		     ("Buffer fill at each period", "", [module](Menu* menu) {
+			append_fill_histogram(menu, module);
+		     }));
+      menu->addChild(createSubmenuItem
+		     ("Time Rack waited on JACK", "", [module](Menu* menu) {
+			append_stall_histogram(menu, module);
+		     }));
+      menu->addChild(createMenuItem("Reset histograms", "", [module]() {
+	 module->fill_histogram.reset();
+	 module->stall_histogram.reset();
+      }));
+   }
+
+   /* both measured against the system clock, so the difference is rack
+    * against jack, which is what makes a buffer creep one way */
+   menu->addChild(new MenuSeparator);
+   menu->addChild(createMenuLabel("Clocks"));
+   menu->addChild(createMenuLabel("JACK: " + clock_reading(g_transport.jack_clock)));
+   float reported_ppm = g_transport.jack_reported_drift_ppm();
+   if (reported_ppm != 0.f) {
+      menu->addChild(createMenuLabel
+		     (string::f("JACK, by its own reckoning: %+.1f ppm", reported_ppm)));
+   }
+   if (g_transport.jack_clock.resyncs) {
+      menu->addChild(createMenuLabel
+		     (string::f("JACK periods skipped: %lu", g_transport.jack_clock.resyncs.load())));
+   }
+   if (module) {
+      menu->addChild(createMenuLabel("Rack engine: " + clock_reading(module->rack_clock)));
+      if (module->rack_clock.settled && g_transport.jack_clock.settled) {
+	 menu->addChild(createMenuLabel
+			(string::f("Rack against JACK: %+.1f ppm",
+				   module->rack_clock.drift_ppm - g_transport.jack_clock.drift_ppm)));
+      }
+   }
+
+   menu->addChild(new MenuSeparator);
+   menu->addChild(createMenuLabel("Realtime thread"));
+   menu->addChild(createMenuLabel
+		  (string::f("Denormals flushed: %s",
+			     g_jack_client.rt_denormals_flushed ? "yes" : "no")));
+   menu->addChild(createMenuLabel
+		  (string::f("Stack prefaulted: %d KiB",
+			     (int)(g_jack_client.rt_stack_prefaulted / 1024))));
+
+   /* ENOMEM is RLIMIT_MEMLOCK being too low for all of it; see
+    * `ulimit -l`, or limits.conf for the audio group */
+   std::string locked = memory_lock::error() == ENOMEM ? "over ulimit -l"
+      : memory_lock::error() ? strerror(memory_lock::error())
+      : memory_lock::enabled() ? string::f("%d KiB", (int)(memory_lock::locked() / 1024))
+      : "";
+   menu->addChild(createBoolMenuItem
+		  ("Lock realtime memory", locked,
+		   []() { return g_lock_memory; },
+		   [](bool lock) {
+		      g_lock_memory = lock;
+		      memory_lock::enable(lock);
+		   }));
+
+   menu->addChild(new MenuSeparator);
+   menu->addChild(createBoolMenuItem
+		  ("Publish metrics", STKJACK_METRICS_PREFIX "<pid>",
+		   []() { return g_export_metrics; },
+		   [](bool enabled) {
+		      g_export_metrics = enabled;
+		      g_metrics.enable(enabled);
+		   }));
+
+#ifdef STKJACK_TRACE
+   menu->addChild(new MenuSeparator);
+   if (trace::saving()) {
+      menu->addChild(createMenuLabel("Saving trace..."));
+   } else if (trace::recording()) {
+      menu->addChild(createMenuItem("Stop trace and save", "", []() {
+	 std::string path = asset::user
+	    (string::f("StkJack-trace-%lld.json", (long long)time(NULL)));
+	 INFO("Saving a trace to %s", path.c_str());
+	 trace::stop_and_save(path);
+      }));
+   } else {
+      menu->addChild(createMenuItem("Start trace", "", []() { trace::start(); }));
+   }
+#endif
+}
+
+void jack_audio_module_widget_base::appendContextMenu(Menu* menu) {
+   menu->addChild(new MenuSeparator);
+   auto module = dynamic_cast<jack_audio_module_base*>(this->module);
+   menu->addChild(createSubmenuItem("Diagnostics", "", [module](Menu* menu) {
+      append_diagnostics(menu, module);
+   }));
 }
 
 // Specify the Module and ModuleWidget subclass, human-readable
@@ -275,4 +568,24 @@ Model* jack_audio_out8_model =
    createModel<jack_audio_out8_module, jack_audio_out8_module_widget>("RackJack8");
 
 Model* jack_audio_in8_model =
-   createModel<jack_audio_in8_module, jack_audio_in8_module_widget>("JackRack8");
\ No newline at end of file
+   createModel<jack_audio_in8_module, jack_audio_in8_module_widget>("JackRack8");
+Model* jack_audio_out16_model =
+   createModel<jack_audio_out16_module, jack_audio_module_widget<16, 0> >("RackJack16");
+
+Model* jack_audio_in16_model =
+   createModel<jack_audio_in16_module, jack_audio_module_widget<0, 16> >("JackRack16");
+
+Model* jack_audio_out32_model =
+   createModel<jack_audio_out32_module, jack_audio_module_widget<32, 0> >("RackJack32");
+
+Model* jack_audio_in32_model =
+   createModel<jack_audio_in32_module, jack_audio_module_widget<0, 32> >("JackRack32");
+
+Model* jack_audio_out64_model =
+   createModel<jack_audio_out64_module, jack_audio_module_widget<64, 0> >("RackJack64");
+
+Model* jack_audio_in64_model =
+   createModel<jack_audio_in64_module, jack_audio_module_widget<0, 64> >("JackRack64");
+
+Model* jack_audio_poly_model =
+   createModel<jack_audio_poly_module, jack_audio_poly_module_widget>("JackPoly");
@@ -3,29 +3,72 @@
 #include "skjack.hh"
 
 struct jack_audio_module_widget_base: public ModuleWidget {
-   TextField* port_names[8];
+   std::vector<TextField*> port_names;
 
-   jack_audio_module_widget_base(jack_audio_module_base* module);
+   /* lays out `to_jack` rack inputs followed by `from_jack` rack outputs,
+    * eight to a column. `panel` is an svg in our resources; if NULL a
+    * plain panel wide enough for every column is drawn instead. */
+   jack_audio_module_widget_base(jack_audio_module_base* module,
+				 size_t to_jack, size_t from_jack,
+				 const char* panel);
    virtual ~jack_audio_module_widget_base();
 
    // hook to do something when a text widget reports a port has been
    // named.
-   void on_port_renamed(int port, const std::string& name);
+   virtual void on_port_renamed(int port, const std::string& name);
 
-   void assume_default_port_names();
+   virtual void assume_default_port_names();
+
+   // the client has named some of the module's ports other than we last
+   // showed, e.g. numbered them or kept the old name; show what it did
+   virtual void on_port_names_applied();
+
+   // whether a port on the panel is connected to anything in jack; read
+   // from the client's cache, so cheap enough to ask every frame
+   virtual bool port_connected(int port);
+
+   void step() override;
+   void appendContextMenu(Menu* menu) override;
+
+protected:
+   // just the panel and screws; the caller places its own ports
+   jack_audio_module_widget_base(jack_audio_module_base* module,
+				 size_t columns, const char* panel);
+
+   // a jack and its name field in `slot` of the usual eight row layout;
+   // `id` is the rack input or output it is wired to
+   void add_port(size_t slot, bool to_jack, int id, bool jacks_left);
+};
+
+// any module shape, on a generated panel
+template <size_t TO_JACK, size_t FROM_JACK>
+struct jack_audio_module_widget: public jack_audio_module_widget_base {
+   jack_audio_module_widget(jack_audio_module<TO_JACK, FROM_JACK>* module)
+      : jack_audio_module_widget_base(module, TO_JACK, FROM_JACK, NULL) {}
 };
 
 struct JackAudioModuleWidget: public jack_audio_module_widget_base {
-   JackAudioModuleWidget(JackAudioModule* module);
+   JackAudioModuleWidget(jack_audio_module<4, 4>* module);
    virtual ~JackAudioModuleWidget();
 };
 
 struct jack_audio_out8_module_widget: public jack_audio_module_widget_base {
-   jack_audio_out8_module_widget(jack_audio_out8_module* module);
+   jack_audio_out8_module_widget(jack_audio_module<8, 0>* module);
    virtual ~jack_audio_out8_module_widget();
 };
 
 struct jack_audio_in8_module_widget: public jack_audio_module_widget_base {
-   jack_audio_in8_module_widget(jack_audio_in8_module* module);
+   jack_audio_in8_module_widget(jack_audio_module<0, 8>* module);
    virtual ~jack_audio_in8_module_widget();
 };
+
+/* two name fields, one per cable; each voice on a cable gets its own
+ * port named after it, so a "port" on this widget is a cable. */
+struct jack_audio_poly_module_widget: public jack_audio_module_widget_base {
+   jack_audio_poly_module_widget(jack_audio_poly_module* module);
+
+   void on_port_renamed(int cable, const std::string& name) override;
+   void assume_default_port_names() override;
+   void on_port_names_applied() override;
+   bool port_connected(int cable) override;
+};
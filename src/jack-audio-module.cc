@@ -1,339 +1,351 @@
 #include "jack-audio-module.hh"
 #include "hashids.hh"
+#include "voltage-marshal.hh"
 
 #include <algorithm>
+#include <set>
 
-// NOTE: The AUDIO_OUTPUTS and AUDIO_INPUTS constants have mostly lost
-// their meaning through several updates. If either is changed from 4
-// then stupidity will occur. Likely we should just remove them since
-// they are now unhelpful and will inevitably give someone the
-// impression that they can be changed.
-
-void JackAudioModule::process(const ProcessArgs &args) {
-   if (!g_jack_client.alive()) return;
-
-   // == PREPARE SAMPLE RATE STUFF ==
-   int sampleRate = (int) args.sampleRate;
-   inputSrc.setRates(g_jack_client.samplerate, sampleRate);
-   outputSrc.setRates(sampleRate, g_jack_client.samplerate);
-
-   // == FROM JACK TO RACK ==
-   if (rack_input_buffer.empty() && !jack_input_buffer.empty()) {
-      int inLen = jack_input_buffer.size();
-      int outLen = rack_input_buffer.capacity();
-      inputSrc.process
-	 (jack_input_buffer.startData(),
-	  &inLen, rack_input_buffer.endData(), &outLen);
-      jack_input_buffer.startIncr(inLen);
-      rack_input_buffer.endIncr(outLen);
-   }
+template <size_t TO_JACK, size_t FROM_JACK>
+void jack_audio_module<TO_JACK, FROM_JACK>::process(const ProcessArgs &args) {
+   if (!jack_ready()) return;
 
-   if (!rack_input_buffer.empty()) {
-      dsp::Frame<AUDIO_OUTPUTS> input_frame = rack_input_buffer.shift();
-      for (int i = 0; i < AUDIO_INPUTS; i++) {
-	 outputs[AUDIO_OUTPUT+i].setVoltage(input_frame.samples[i] * 10.0f);
-      }
-   }
+   if (activity_divider.process()) {
+      uint64_t was_active = from_jack_active;
+      refresh_activity();
 
-   // == FROM RACK TO JACK ==
-   if (!rack_output_buffer.full()) {
-      dsp::Frame<AUDIO_OUTPUTS> outputFrame;
-      for (int i = 0; i < AUDIO_OUTPUTS; i++) {
-	 outputFrame.samples[i] = inputs[AUDIO_INPUT + i].getVoltage() / 10.0f;
+      // outputs which just went quiet would otherwise hold their last voltage
+      uint64_t silenced = was_active & ~from_jack_active;
+      for (int i = 0; i < (int)FROM_JACK; i++) {
+	 if (silenced & (uint64_t(1) << i)) {
+	    outputs[AUDIO_OUTPUT+i].setVoltage(0.f);
+	 }
       }
-      rack_output_buffer.push(outputFrame);
    }
 
-   if (rack_output_buffer.full()) {
-      int inLen = rack_output_buffer.size();
-      int outLen = jack_output_buffer.capacity();
-      outputSrc.process
-	 (rack_output_buffer.startData(),
-	  &inLen, jack_output_buffer.endData(), &outLen);
-      rack_output_buffer.startIncr(inLen);
-      jack_output_buffer.endIncr(outLen);
-   }
+   uint64_t to_active = to_jack_active.load(std::memory_order_relaxed);
+   uint64_t from_active = from_jack_active.load(std::memory_order_relaxed);
+
+   lanes.step(*this, (int)args.sampleRate, g_jack_client.samplerate,
+	      // == FROM JACK TO RACK ==
+	      [this, from_active](const float* samples) {
+		 scatter_voltages(samples, &outputs[AUDIO_OUTPUT], FROM_JACK, from_active);
+	      },
+	      // == FROM RACK TO JACK ==
+	      [this, to_active](float* samples) {
+		 gather_voltages(&inputs[AUDIO_INPUT], samples, TO_JACK, to_active);
+	      });
+}
 
-   // TODO: consider capping this? although an overflow here doesn't cause crashes...
-   if (jack_output_buffer.size() > (g_jack_client.buffersize * 8)) {
-      report_backlogged();
-   }
+template <size_t TO_JACK, size_t FROM_JACK>
+void jack_audio_module<TO_JACK, FROM_JACK>::on_jack_period(jack_nframes_t nframes) {
+   jack_default_audio_sample_t* buffers[TO_JACK + FROM_JACK];
+   collect_buffers(buffers, nframes);
+   lanes.exchange(*this, buffers, nframes);
 }
 
-void jack_audio_module_base::report_backlogged() {
-   // we're over half capacity, so set our output latch
-   if (output_latch.try_set()) {
-      g_audio_blocked++;
-   }
+template <size_t TO_JACK, size_t FROM_JACK>
+bool jack_audio_module<TO_JACK, FROM_JACK>::period_ready(jack_nframes_t nframes) {
+   return lanes.ready(nframes);
+}
 
-   // if everyone is output latched, stall Rack
-   if (g_audio_blocked >= g_audio_modules.size()) {
-      std::unique_lock<std::mutex> lock(jmutex);
-      g_jack_cv.wait(lock);
-   }
+bool jack_audio_module_base::rack_side_connected(size_t port) {
+   if (port < to_jack_ports) return inputs[port].isConnected();
+   return outputs[port - to_jack_ports].isConnected();
 }
 
-void jack_audio_module_base::assign_stupid_port_names() {
-   // TODO deduplicate with same code on the widget side
-   /* use the pointer to ourselves as a random unique port name */
+void jack_audio_module_base::on_jack_lost() {
+   for (auto& output : outputs) output.clearVoltages();
+}
+
+/* identities held by modules which exist right now. a duplicated
+ * module, or a preset loaded while its original is still about, comes
+ * with an identity somebody already has. */
+static std::mutex g_identities_mutex;
+static std::set<std::string> g_identities;
+
+static bool claim_identity(const std::string& identity) {
+   std::lock_guard<std::mutex> lock(g_identities_mutex);
+   return g_identities.insert(identity).second;
+}
+
+static void release_identity(const std::string& identity) {
+   std::lock_guard<std::mutex> lock(g_identities_mutex);
+   g_identities.erase(identity);
+}
+
+/* a short random id for a new module, which is then ours until we go.
+ * it is saved with the patch, so unnamed ports come back under the
+ * same names next session and whatever was patched to them can find
+ * them again. */
+std::string jack_audio_module_base::make_identity() {
+   // building one shuffles its whole alphabet, so only do it once
+   static const hashidsxx::Hashids hash(g_hashid_salt);
+   std::string identity;
+   do {
+      identity = hash.encode(random::u32());
+   } while (!claim_identity(identity));
+   return identity;
+}
+
+// the name a port gets when nobody has named it
+std::string jack_audio_module_base::default_port_name(const std::string& identity, size_t port) {
    char port_name[128];
-   if (g_jack_client.alive()) {
-      hashidsxx::Hashids hash(g_hashid_salt);
-      std::string id = hash.encode(reinterpret_cast<size_t>(this));
-
-      for (int i = 0; i < JACK_PORTS; i++) {
-	 snprintf
-	    (reinterpret_cast<char*>(&port_name),
-	     128,
-	     "%s:%d",
-	     id.c_str(),
-	     i);
-
-	 unsigned int flags = 0;
-	 switch (role) {
-	    case ROLE_DUPLEX:
-	       flags = (i < AUDIO_OUTPUTS ? JackPortIsOutput : JackPortIsInput);
-	       break;
-	    case ROLE_OUTPUT:
-	       flags = JackPortIsOutput;
-	       break;
-	    case ROLE_INPUT:
-	       flags = JackPortIsInput;
-	       break;
-	 }
+   snprintf
+      (reinterpret_cast<char*>(&port_name),
+       128,
+       "%s:%d",
+       identity.c_str(),
+       (int)port);
+   return std::string(port_name);
+}
 
-	 jport[i].register_audio
-	    (g_jack_client,
-	     reinterpret_cast<const char*>(&port_name), flags);
-      }
+std::string jack_audio_module_base::stupid_port_name(size_t port) {
+   return default_port_name(identity, port);
+}
+
+/* only names the ports; nothing exists in jack until we are added to
+ * the engine, by when a patch being loaded has told us their real names */
+void jack_audio_module_base::assign_stupid_port_names() {
+   for (size_t i = 0; i < jack_ports(); i++) {
+      port_names[i] = stupid_port_name(i);
    }
 }
 
+void jack_audio_module_base::onAdd(const AddEvent& e) {
+   Module::onAdd(e);
+   on_added();
+}
+
 json_t* jack_audio_module_base::toJson() {
    auto map = Module::toJson();
    auto pt_names = json_array();
 
-   for (int i = 0; i < JACK_PORTS; i++) {
+   for (size_t i = 0; i < jack_ports(); i++) {
       auto str = json_string(this->port_names[i].c_str());
       json_array_append_new(pt_names, str);
    }
 
    json_object_set_new(map, "port_names", pt_names);
+   json_object_set_new(map, "identity", json_string(identity.c_str()));
+
+   // what each port is patched to in jack
+   auto pt_connections = json_array();
+   for (size_t i = 0; i < jack_ports(); i++) {
+      auto list = json_array();
+      for (auto& peer : connections_of(i)) {
+	 json_array_append_new(list, json_string(peer.c_str()));
+      }
+      json_array_append_new(pt_connections, list);
+   }
+
+   json_object_set_new(map, "port_connections", pt_connections);
    return map;
 }
 
 void jack_audio_module_base::fromJson(json_t* json) {
-   auto module = reinterpret_cast<JackAudioModule*>(this);
+   /* a live module already going by the saved identity means we are a
+    * copy of it. we keep our own then, and with it our own port names
+    * and none of its jack connections. */
+   std::string saved_identity = identity;
+   bool copy = false;
+   auto id = json_object_get(json, "identity");
+   if (json_is_string(id) && *json_string_value(id)
+       && identity != json_string_value(id))
+   {
+      saved_identity = json_string_value(id);
+      if (claim_identity(saved_identity)) {
+	 release_identity(identity);
+	 identity = saved_identity;
+      } else {
+	 copy = true;
+      }
+   }
+
    auto pt_names = json_object_get(json, "port_names");
    if (json_is_array(pt_names)) {
-      for (size_t i = 0; i < std::min(json_array_size(pt_names), (size_t)8); i++) {
+      for (size_t i = 0; i < std::min(json_array_size(pt_names), jack_ports()); i++) {
     auto item = json_array_get(pt_names, i);
-    if (json_is_string(item)) {
-       int error = module->jport[i].rename(json_string_value(item));
-       if (error == 0) {
-           DEBUG("Changing port name to %s successful",this->port_names[i].c_str());
-           this->port_names[i] = std::string(json_string_value(item));
-       } else {
-           DEBUG("Changing port name failed: %s, %d", json_string_value(item), error);
-           static const size_t buffer_size = 128;
-           char port_name[buffer_size];
-           hashidsxx::Hashids hash(g_hashid_salt);
-           std::string id = hash.encode(reinterpret_cast<size_t>(module));
-
-           snprintf(reinterpret_cast<char*>(&port_name),
-             buffer_size,
-             "%s:%d", id.c_str(), (int)i);
-          this->port_names[i] = std::string(port_name);
-       }
+    if (!json_is_string(item)) continue;
+
+    std::string name = json_string_value(item);
+    if (copy && name == default_port_name(saved_identity, i)) {
+       name = stupid_port_name(i);
+    }
+
+    // not made yet; it will be registered under this name directly
+    if (!jport[i].alive()) {
+       this->port_names[i] = name;
+       continue;
+    }
+
+    // for now; the widget picks up what the client really named it
+    int error = jport[i].rename(name);
+    if (error == 0) {
+        DEBUG("Renaming port to %s", name.c_str());
+        this->port_names[i] = name;
+    } else {
+        DEBUG("Changing port name failed: %s, %d", name.c_str(), error);
+       this->port_names[i] = stupid_port_name(i);
     }
       }
    }
-}
 
-JackAudioModule::JackAudioModule()
-   : jack_audio_module_base(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS)
-{
-   assign_stupid_port_names();
+   auto pt_connections = json_object_get(json, "port_connections");
+   if (!copy && json_is_array(pt_connections)) {
+      for (size_t i = 0; i < std::min(json_array_size(pt_connections), jack_ports()); i++) {
+	 auto list = json_array_get(pt_connections, i);
+	 if (!json_is_array(list)) continue;
 
-   inputSrc.setChannels(AUDIO_INPUTS);
-   outputSrc.setChannels(AUDIO_OUTPUTS);
+	 std::vector<std::string> peers;
+	 for (size_t j = 0; j < json_array_size(list); j++) {
+	    auto item = json_array_get(list, j);
+	    if (json_is_string(item)) peers.push_back(json_string_value(item));
+	 }
 
-   globally_register();
+	 restore_connections(i, peers);
+      }
+   }
+
+   // a preset loaded on to a module whose ports are still on their way
+   request_ports();
 }
 
 jack_audio_module_base::jack_audio_module_base
-(size_t params, size_t inputs, size_t outputs, size_t lights)
+(size_t to_jack, size_t from_jack,
+ size_t params, size_t inputs, size_t outputs, size_t lights)
    : Module(params, inputs, outputs, lights),
-     role(ROLE_DUPLEX),
-     output_latch(), inputSrc(), outputSrc()
+     jack_module_ports(g_jack_client, g_transport, to_jack, from_jack),
+     identity(make_identity())
 {
+   // nothing touches jack until somebody actually wants it
+   start_jack_client();
+
+   activity_divider.setDivision(256);
 }
 
 jack_audio_module_base::~jack_audio_module_base() {
-   // unregister from client
+   // our ports go with jack_module_ports
    globally_unregister();
-
-   // kill our port
-   if (!g_jack_client.alive()) return;
-   for (int i = 0; i < JACK_PORTS; i++) {
-      jport[i].unregister();
-   }
+   release_identity(identity);
 }
 
-void jack_audio_module_base::wipe_buffers() {
-   rack_input_buffer.clear();
-   rack_output_buffer.clear();
-   jack_input_buffer.clear();
-   jack_output_buffer.clear();
-}
-
-void jack_audio_module_base::globally_register() {
-   std::unique_lock<std::mutex> lock(g_audio_modules_mutex);
-
-   g_audio_modules.push_back(this);
-
-   /* ensure modules are not filling up their buffers out of sync */
-   for (auto itr = g_audio_modules.begin();
-	itr != g_audio_modules.end();
-	itr++)
-   {
-      (*itr)->wipe_buffers();
-   }
+template <size_t TO_JACK, size_t FROM_JACK>
+jack_audio_module<TO_JACK, FROM_JACK>::jack_audio_module()
+   : jack_audio_module_base(TO_JACK, FROM_JACK,
+			    NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS)
+{
+   assign_stupid_port_names();
+   globally_register();
 }
 
-void jack_audio_module_base::globally_unregister() {
-   std::unique_lock<std::mutex> lock(g_audio_modules_mutex);
-
-   /* drop ourselves from active module list */
-   auto x = std::find(g_audio_modules.begin(), g_audio_modules.end(), this);
-   if (x != g_audio_modules.end())
-      g_audio_modules.erase(x);
+template <size_t TO_JACK, size_t FROM_JACK>
+jack_audio_module<TO_JACK, FROM_JACK>::~jack_audio_module() {
+   /* the jack thread calls back in to us, so leave before our lanes are
+    * torn down rather than waiting for the base destructor */
+   globally_unregister();
 }
 
-JackAudioModule::~JackAudioModule() {}
-
-jack_audio_out8_module::jack_audio_out8_module()
-   : jack_audio_module_base(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS)
+template struct jack_audio_module<4, 4>;
+template struct jack_audio_module<8, 0>;
+template struct jack_audio_module<16, 0>;
+template struct jack_audio_module<32, 0>;
+template struct jack_audio_module<64, 0>;
+template struct jack_audio_module<0, 8>;
+template struct jack_audio_module<0, 16>;
+template struct jack_audio_module<0, 32>;
+template struct jack_audio_module<0, 64>;
+
+jack_audio_poly_module::jack_audio_poly_module()
+   : jack_audio_module_base(VOICES, VOICES,
+			    NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS)
 {
-   role = ROLE_OUTPUT;
    assign_stupid_port_names();
-
-   inputSrc.setChannels(AUDIO_INPUTS);
-   outputSrc.setChannels(AUDIO_OUTPUTS);
-
    globally_register();
 }
 
-jack_audio_out8_module::~jack_audio_out8_module() {}
-
-void jack_audio_out8_module::process(const ProcessArgs &args) {
-   if (!g_jack_client.alive()) return;
-
-   // == PREPARE SAMPLE RATE STUFF ==
-   int sampleRate = (int) args.sampleRate;
-   // not a bug; we're abusing both input and output pipes to be output pipes
-   inputSrc.setRates(sampleRate, g_jack_client.samplerate);
-   outputSrc.setRates(sampleRate, g_jack_client.samplerate);
-
-   // == FROM RACK TO JACK ==
-   if (!rack_output_buffer.full()) {
-      dsp::Frame<AUDIO_OUTPUTS> outputFrame;
-      for (int i = 0; i < 4; i++) {
-	 outputFrame.samples[i] = inputs[AUDIO_INPUT + i].getVoltage() / 10.0f;
-      }
-      rack_output_buffer.push(outputFrame);
+jack_audio_poly_module::~jack_audio_poly_module() {
+   globally_unregister();
+}
 
-      for (int i = 0; i < 4; i++) {
-	 outputFrame.samples[i] = inputs[AUDIO_INPUT + i + 4].getVoltage() / 10.0f;
+void jack_audio_poly_module::process(const ProcessArgs &args) {
+   if (!jack_ready()) return;
+
+   /* the returning cable carries as many voices as the outgoing one, so
+    * an effect loop through jack keeps its voice count; with nothing
+    * going out every port comes back. rack clears voltages above the
+    * channel count, so unused ports simply send silence. */
+   int channels = inputs[POLY_INPUT].getChannels();
+   if (channels == 0) channels = VOICES;
+   outputs[POLY_OUTPUT].setChannels(channels);
+
+   if (activity_divider.process()) {
+      uint64_t was_active = from_jack_active;
+      refresh_activity();
+
+      // voices which just went quiet would otherwise hold their last voltage
+      uint64_t silenced = was_active & ~from_jack_active;
+      for (int c = 0; c < channels; c++) {
+	 if (silenced & (uint64_t(1) << c)) {
+	    outputs[POLY_OUTPUT].setVoltage(0.f, c);
+	 }
       }
-      rack_input_buffer.push(outputFrame);
-   }
-
-   if (rack_output_buffer.full()) {
-      int inLen = rack_output_buffer.size();
-      int outLen = jack_output_buffer.capacity();
-      outputSrc.process
-	 (rack_output_buffer.startData(),
-	  &inLen, jack_output_buffer.endData(), &outLen);
-      rack_output_buffer.startIncr(inLen);
-      jack_output_buffer.endIncr(outLen);
-
-      inLen = rack_input_buffer.size();
-      outLen = jack_input_buffer.capacity();
-      inputSrc.process
-	 (rack_input_buffer.startData(),
-	  &inLen, jack_input_buffer.endData(), &outLen);
-      rack_input_buffer.startIncr(inLen);
-      jack_input_buffer.endIncr(outLen);
    }
 
-   // TODO: consider capping this?
-   // although an overflow here doesn't cause crashes...
-   if (jack_output_buffer.size() > (g_jack_client.buffersize * 8)) {
-      report_backlogged();
-   }
+   uint64_t to_active = to_jack_active.load(std::memory_order_relaxed);
+   uint64_t from_active = from_jack_active.load(std::memory_order_relaxed);
+
+   lanes.step(*this, (int)args.sampleRate, g_jack_client.samplerate,
+	      // == FROM JACK TO RACK ==
+	      [this, channels, from_active](const float* samples) {
+		 scatter_poly_voltages(samples, outputs[POLY_OUTPUT], channels, from_active);
+	      },
+	      // == FROM RACK TO JACK ==
+	      [this, to_active](float* samples) {
+		 gather_poly_voltages(inputs[POLY_INPUT], samples, VOICES, to_active);
+	      });
 }
 
-jack_audio_in8_module::jack_audio_in8_module()
-   : jack_audio_module_base(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS)
-{
-   role = ROLE_INPUT;
-   assign_stupid_port_names();
-
-   inputSrc.setChannels(AUDIO_INPUTS);
-   outputSrc.setChannels(AUDIO_OUTPUTS);
+void jack_audio_poly_module::on_jack_period(jack_nframes_t nframes) {
+   jack_default_audio_sample_t* buffers[VOICES * 2];
+   collect_buffers(buffers, nframes);
+   lanes.exchange(*this, buffers, nframes);
+}
 
-   globally_register();
+bool jack_audio_poly_module::period_ready(jack_nframes_t nframes) {
+   return lanes.ready(nframes);
 }
 
-jack_audio_in8_module::~jack_audio_in8_module() {}
-
-void jack_audio_in8_module::process(const ProcessArgs &args) {
-   if (!g_jack_client.alive()) return;
-
-   // == PREPARE SAMPLE RATE STUFF ==
-   int sampleRate = (int) args.sampleRate;
-   // not a bug; we're abusing both input and output pipes to be output pipes
-   inputSrc.setRates(g_jack_client.samplerate, sampleRate);
-   outputSrc.setRates(g_jack_client.samplerate, sampleRate);
-
-   // == FROM JACK TO RACK ==
-   if (rack_output_buffer.empty() && !jack_output_buffer.empty()) {
-      int inLen = jack_output_buffer.size();
-      int outLen = rack_output_buffer.capacity();
-      outputSrc.process
-	 (jack_output_buffer.startData(),
-	  &inLen, rack_output_buffer.endData(), &outLen);
-      jack_output_buffer.startIncr(inLen);
-      rack_output_buffer.endIncr(outLen);
+// voices are in use while the cable carries them
+bool jack_audio_poly_module::rack_side_connected(size_t port) {
+   if (port < VOICES) {
+      return (int)port < inputs[POLY_INPUT].getChannels();
    }
+   return outputs[POLY_OUTPUT].isConnected()
+      && (int)(port - VOICES) < outputs[POLY_OUTPUT].getChannels();
+}
 
-   if (!rack_output_buffer.empty()) {
-      dsp::Frame<AUDIO_OUTPUTS> output_frame = rack_output_buffer.shift();
-      for (int i = 0; i < AUDIO_OUTPUTS; i++) {
-	 outputs[AUDIO_OUTPUT+i].setVoltage(output_frame.samples[i] * 10.0f);
-      }
-   }
+json_t* jack_audio_poly_module::toJson() {
+   auto map = jack_audio_module_base::toJson();
+   auto names = json_array();
 
-   if (rack_input_buffer.empty() && !jack_input_buffer.empty()) {
-      int inLen = jack_input_buffer.size();
-      int outLen = rack_input_buffer.capacity();
-      inputSrc.process
-	 (jack_input_buffer.startData(),
-	  &inLen, rack_input_buffer.endData(), &outLen);
-      jack_input_buffer.startIncr(inLen);
-      rack_input_buffer.endIncr(outLen);
+   for (int i = 0; i < 2; i++) {
+      json_array_append_new(names, json_string(poly_names[i].c_str()));
    }
 
-   if (!rack_input_buffer.empty()) {
-      dsp::Frame<AUDIO_INPUTS> input_frame = rack_input_buffer.shift();
-      for (int i = 0; i < AUDIO_INPUTS; i++) {
-	 outputs[AUDIO_OUTPUT+AUDIO_OUTPUTS+i].value =
-	   input_frame.samples[i] * 10.0f;
-      }
-   }
+   json_object_set_new(map, "poly_names", names);
+   return map;
+}
+
+void jack_audio_poly_module::fromJson(json_t* json) {
+   jack_audio_module_base::fromJson(json);
 
-   if (jack_output_buffer.size() < (g_jack_client.buffersize * 8)) {
-      report_backlogged();
+   auto names = json_object_get(json, "poly_names");
+   if (json_is_array(names)) {
+      for (size_t i = 0; i < std::min(json_array_size(names), (size_t)2); i++) {
+	 auto item = json_array_get(names, i);
+	 if (json_is_string(item)) {
+	    poly_names[i] = json_string_value(item);
+	 }
+      }
    }
 }
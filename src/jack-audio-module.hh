@@ -1,105 +1,127 @@
 #pragma once
 
 #include "skjack.hh"
-#include "dsp/resampler.hpp"
-#include "dsp/ringbuffer.hpp"
-#include "sr-latch.hh"
-
-#define AUDIO_OUTPUTS 4
-#define AUDIO_INPUTS 4
-#define JACK_PORTS (AUDIO_OUTPUTS + AUDIO_INPUTS)
-
-struct jack_audio_module_base: public Module {
-   enum role_t {
-      ROLE_DUPLEX,		// standard skjack module
-      ROLE_OUTPUT,		// all ports are outputs
-      ROLE_INPUT		// all ports are inputs
-   };
-
-   role_t role;
-   sr_latch output_latch;
+#include "jack-module-ports.hh"
 
+/* a rack module with jack ports. moving the audio is left to the
+ * transport and the ports' comings and goings to jack_module_ports;
+ * this looks after their names, their rack side and the patch. */
+struct jack_audio_module_base: public Module, public jack_module_ports {
    int lastSampleRate = 0;
    int lastNumOutputs = -1;
    int lastNumInputs = -1;
 
-   dsp::SampleRateConverter<AUDIO_INPUTS> inputSrc;
-   dsp::SampleRateConverter<AUDIO_OUTPUTS> outputSrc;
+   // made up once per module and kept in the patch, and never shared
+   // by two live modules; ports nobody has named are named after it.
+   // the widget reads it too.
+   std::string identity;
 
-   // in rack's sample rate
-   dsp::DoubleRingBuffer<dsp::Frame<AUDIO_INPUTS>, 16> rack_input_buffer;
-   dsp::DoubleRingBuffer<dsp::Frame<AUDIO_OUTPUTS>, 16> rack_output_buffer;
-   dsp::DoubleRingBuffer<dsp::Frame<AUDIO_INPUTS>, (1<<15)> jack_input_buffer;
-   dsp::DoubleRingBuffer<dsp::Frame<AUDIO_OUTPUTS>, (1<<15)> jack_output_buffer;
+   dsp::ClockDivider activity_divider;
 
-   std::mutex jmutex;
-   jaq::port jport[JACK_PORTS];
+   // defaults to the input or output cable of the same number
+   virtual bool rack_side_connected(size_t port) override;
+   void on_jack_lost() override;
 
-   std::string port_names[8];
-
-   void wipe_buffers();
-   void globally_register();
-   void globally_unregister();
    void assign_stupid_port_names();
+   std::string stupid_port_name(size_t port);
+
+   static std::string make_identity();
+   static std::string default_port_name(const std::string& identity, size_t port);
 
-   void report_backlogged();
+   void onAdd(const AddEvent& e) override;
 
    virtual json_t* toJson() override;
    virtual void fromJson(json_t* json) override;
 
-   jack_audio_module_base(size_t params, size_t inputs,
+   jack_audio_module_base(size_t to_jack, size_t from_jack,
+			  size_t params, size_t inputs,
 			  size_t outputs, size_t lights);
    virtual ~jack_audio_module_base();
 };
 
-struct JackAudioModule: public jack_audio_module_base {
+/* a module with TO_JACK rack inputs sent out through jack output ports,
+ * and FROM_JACK jack input ports delivered to rack outputs. either may
+ * be zero. */
+template <size_t TO_JACK, size_t FROM_JACK>
+struct jack_audio_module: public jack_audio_module_base {
+   static_assert(TO_JACK % 4 == 0 && FROM_JACK % 4 == 0,
+		 "ports are moved between rack and jack four at a time");
+
    enum ParamIds {
       NUM_PARAMS
    };
+   // spelled out rather than ENUMS() as either count may be zero
    enum InputIds {
-      ENUMS(AUDIO_INPUT, AUDIO_INPUTS),
-      NUM_INPUTS
+      AUDIO_INPUT,
+      NUM_INPUTS = AUDIO_INPUT + TO_JACK
    };
    enum OutputIds {
-      ENUMS(AUDIO_OUTPUT, AUDIO_OUTPUTS),
-      NUM_OUTPUTS
+      AUDIO_OUTPUT,
+      NUM_OUTPUTS = AUDIO_OUTPUT + FROM_JACK
    };
    enum LightIds {
       NUM_LIGHTS
    };
 
-   JackAudioModule();
-   virtual ~JackAudioModule();
+   jack_lanes<TO_JACK, FROM_JACK> lanes;
+
+   jack_audio_module();
+   virtual ~jack_audio_module();
 
    void process(const ProcessArgs &args) override;
+   void on_jack_period(jack_nframes_t nframes) override;
+   bool period_ready(jack_nframes_t nframes) override;
 };
 
-struct jack_audio_out8_module: public jack_audio_module_base {
-   enum ParamIds { NUM_PARAMS }; // none
-   enum InputIds {
-      ENUMS(AUDIO_INPUT, JACK_PORTS),
-      NUM_INPUTS
-   };
-   enum OutputIds { NUM_OUTPUTS }; // none
-   enum LightIds { NUM_LIGHTS };   // none
+// 4 rack->jack and 4 jack->rack
+typedef jack_audio_module<4, 4> JackAudioModule;
 
-   jack_audio_out8_module();
-   virtual ~jack_audio_out8_module();
+// all ports send rack audio to jack
+typedef jack_audio_module<8, 0> jack_audio_out8_module;
+typedef jack_audio_module<16, 0> jack_audio_out16_module;
+typedef jack_audio_module<32, 0> jack_audio_out32_module;
+typedef jack_audio_module<64, 0> jack_audio_out64_module;
 
-   void process(const ProcessArgs &args) override;
-};
+// all ports send jack audio to rack
+typedef jack_audio_module<0, 8> jack_audio_in8_module;
+typedef jack_audio_module<0, 16> jack_audio_in16_module;
+typedef jack_audio_module<0, 32> jack_audio_in32_module;
+typedef jack_audio_module<0, 64> jack_audio_in64_module;
+
+/* one polyphonic rack cable out to 16 jack ports, and 16 jack ports back
+ * in on one polyphonic cable. each channel of the cable is one port. */
+struct jack_audio_poly_module: public jack_audio_module_base {
+   static const size_t VOICES = PORT_MAX_CHANNELS;
 
-struct jack_audio_in8_module: public jack_audio_module_base {
-   enum ParamIds { NUM_PARAMS }; // none
-   enum InputIds { NUM_INPUTS }; // none
+   enum ParamIds {
+      NUM_PARAMS
+   };
+   enum InputIds {
+      POLY_INPUT,
+      NUM_INPUTS
+   };
    enum OutputIds {
-      ENUMS(AUDIO_OUTPUT, JACK_PORTS),
+      POLY_OUTPUT,
       NUM_OUTPUTS
    };
-   enum LightIds { NUM_LIGHTS };   // none
+   enum LightIds {
+      NUM_LIGHTS
+   };
+
+   jack_lanes<VOICES, VOICES> lanes;
+
+   // what each cable has been named on the panel; ports are then named
+   // after their cable and channel
+   std::string poly_names[2];
 
-   jack_audio_in8_module();
-   virtual ~jack_audio_in8_module();
+   jack_audio_poly_module();
+   virtual ~jack_audio_poly_module();
 
    void process(const ProcessArgs &args) override;
+   void on_jack_period(jack_nframes_t nframes) override;
+   bool period_ready(jack_nframes_t nframes) override;
+   bool rack_side_connected(size_t port) override;
+
+   virtual json_t* toJson() override;
+   virtual void fromJson(json_t* json) override;
 };
@@ -0,0 +1,293 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "jack/types.h"
+#include "memory-lock.hh"
+#include "trace.hh"
+#include "dsp/resampler.hpp"
+#include "dsp/ringbuffer.hpp"
+
+/* a lane is one direction of audio moving through a JACK module. it
+ * owns a small buffer at Rack's sample rate, a large one at JACK's
+ * sample rate and the resampler sitting between them.
+ *
+ * lanes with zero channels are empty and every operation on them does
+ * nothing, so a module which only sends or only receives does not have
+ * to special case the direction it doesn't have. */
+
+#define JACK_LANE_FRAMES (1<<15)
+
+// which channels of a lane are in use, one bit each
+#define JACK_LANE_MAX_CHANNELS 64
+
+/* writes over a whole buffer while nobody else can see it yet, so its
+ * pages are in memory before the realtime thread first touches them */
+template <typename T>
+void prefault(T& buffer) {
+   memset(buffer.data, 0, sizeof(buffer.data));
+}
+
+// carries audio from Rack's inputs to JACK output ports
+template <size_t CHANNELS>
+struct rack_to_jack_lane {
+   static_assert(CHANNELS <= JACK_LANE_MAX_CHANNELS, "too many channels for one lane");
+
+   typedef rack::dsp::Frame<CHANNELS> frame_t;
+
+   rack::dsp::SampleRateConverter<CHANNELS> src;
+
+   // in rack's sample rate
+   rack::dsp::DoubleRingBuffer<frame_t, 16> rack_buffer;
+   // in jack's sample rate
+   rack::dsp::DoubleRingBuffer<frame_t, JACK_LANE_FRAMES> jack_buffer;
+
+   rack_to_jack_lane() {
+      src.setChannels(CHANNELS);
+      prefault(rack_buffer);
+      prefault(jack_buffer);
+      memory_lock::add(&jack_buffer, sizeof(jack_buffer));
+   }
+
+   ~rack_to_jack_lane() {
+      memory_lock::remove(&jack_buffer, sizeof(jack_buffer));
+   }
+
+   void set_rates(int rack_rate, int jack_rate) {
+      src.setRates(rack_rate, jack_rate);
+   }
+
+   /* `gather` is handed an array of CHANNELS samples to fill in; it is
+    * only called while there is room for another frame. once a block
+    * has built up it is resampled in to the jack side. */
+   template <typename F>
+   void write(F gather) {
+      if (!rack_buffer.full()) {
+	 frame_t frame;
+	 gather(frame.samples);
+	 rack_buffer.push(frame);
+      }
+
+      if (rack_buffer.full()) {
+	 TRACE_SCOPE("resample to jack");
+	 int inLen = rack_buffer.size();
+	 int outLen = jack_buffer.capacity();
+	 src.process
+	    (rack_buffer.startData(),
+	     &inLen, jack_buffer.endData(), &outLen);
+	 rack_buffer.startIncr(inLen);
+	 jack_buffer.endIncr(outLen);
+      }
+   }
+
+   // frames waiting for jack to collect them
+   size_t backlog() const {
+      return jack_buffer.size();
+   }
+
+   // and those still waiting to be resampled as well
+   size_t in_flight() const {
+      return rack_buffer.size() + jack_buffer.size();
+   }
+
+   // realtime side; true if a whole period can be handed to jack
+   bool ready(jack_nframes_t nframes) const {
+      return jack_buffer.size() >= nframes;
+   }
+
+   /* realtime side; copies one period in to `buffers`, one port's
+    * buffer for each of the CHANNELS. channels whose bit is clear in
+    * `active` have nobody listening on one side or the other, so their
+    * port is just silenced once for the period. */
+   void drain(jack_default_audio_sample_t* const* buffers, jack_nframes_t nframes,
+	      uint64_t active)
+   {
+      // the doubled ring keeps a whole period contiguous
+      const frame_t* frames = jack_buffer.startData();
+
+      for (size_t j = 0; j < CHANNELS; j++) {
+	 auto out = buffers[j];
+	 // no buffer while the port is being made or retired
+	 if (out == NULL) continue;
+
+	 if ((active & (uint64_t(1) << j)) == 0) {
+	    memset(out, 0, sizeof(jack_default_audio_sample_t) * nframes);
+	    continue;
+	 }
+
+	 for (jack_nframes_t i = 0; i < nframes; i++) {
+	    out[i] = frames[i].samples[j];
+	 }
+      }
+
+      jack_buffer.startIncr(nframes);
+   }
+
+   // each side empties what it reads from; the engine reads rack_buffer
+   void clear_engine_side() {
+      rack_buffer.clear();
+   }
+
+   void clear_jack_side() {
+      jack_buffer.clear();
+   }
+};
+
+template <>
+struct rack_to_jack_lane<0> {
+   void set_rates(int, int) {}
+   template <typename F> void write(F) {}
+   size_t backlog() const { return 0; }
+   size_t in_flight() const { return 0; }
+   bool ready(jack_nframes_t) const { return true; }
+   void drain(jack_default_audio_sample_t* const*, jack_nframes_t, uint64_t) {}
+   void clear_engine_side() {}
+   void clear_jack_side() {}
+};
+
+// carries audio from JACK input ports to Rack's outputs
+template <size_t CHANNELS>
+struct jack_to_rack_lane {
+   static_assert(CHANNELS <= JACK_LANE_MAX_CHANNELS, "too many channels for one lane");
+
+   typedef rack::dsp::Frame<CHANNELS> frame_t;
+
+   rack::dsp::SampleRateConverter<CHANNELS> src;
+
+   // in jack's sample rate
+   rack::dsp::DoubleRingBuffer<frame_t, JACK_LANE_FRAMES> jack_buffer;
+   // in rack's sample rate
+   rack::dsp::DoubleRingBuffer<frame_t, 16> rack_buffer;
+
+   jack_to_rack_lane() {
+      src.setChannels(CHANNELS);
+      prefault(jack_buffer);
+      prefault(rack_buffer);
+      memory_lock::add(&jack_buffer, sizeof(jack_buffer));
+   }
+
+   ~jack_to_rack_lane() {
+      memory_lock::remove(&jack_buffer, sizeof(jack_buffer));
+   }
+
+   void set_rates(int jack_rate, int rack_rate) {
+      src.setRates(jack_rate, rack_rate);
+   }
+
+   /* `scatter` is handed an array of CHANNELS samples whenever a frame
+    * is available for Rack. resamples more audio out of the jack side
+    * once the rack side has run dry. */
+   template <typename F>
+   void read(F scatter) {
+      if (rack_buffer.empty() && !jack_buffer.empty()) {
+	 TRACE_SCOPE("resample from jack");
+	 int inLen = jack_buffer.size();
+	 int outLen = rack_buffer.capacity();
+	 src.process
+	    (jack_buffer.startData(),
+	     &inLen, rack_buffer.endData(), &outLen);
+	 jack_buffer.startIncr(inLen);
+	 rack_buffer.endIncr(outLen);
+      }
+
+      if (!rack_buffer.empty()) {
+	 frame_t frame = rack_buffer.shift();
+	 scatter(frame.samples);
+      }
+   }
+
+   // frames waiting for rack to collect them
+   size_t backlog() const {
+      return jack_buffer.size();
+   }
+
+   // and those already resampled for rack as well
+   size_t in_flight() const {
+      return jack_buffer.size() + rack_buffer.size();
+   }
+
+   // realtime side; true if a whole period can be accepted from jack
+   bool room(jack_nframes_t nframes) const {
+      return jack_buffer.capacity() >= nframes;
+   }
+
+   /* realtime side; copies one period out of `buffers`, one port's
+    * buffer for each of the CHANNELS. channels whose bit is clear in
+    * `active` are not read at all and carry silence. */
+   void fill(jack_default_audio_sample_t* const* buffers, jack_nframes_t nframes,
+	     uint64_t active)
+   {
+      frame_t* frames = jack_buffer.endData();
+
+      for (size_t j = 0; j < CHANNELS; j++) {
+	 jack_default_audio_sample_t* in = NULL;
+	 if (active & (uint64_t(1) << j)) {
+	    in = buffers[j];
+	 }
+
+	 // no buffer while the port is being made or retired
+	 if (in == NULL) {
+	    for (jack_nframes_t i = 0; i < nframes; i++) {
+	       frames[i].samples[j] = 0.0;
+	    }
+	 } else {
+	    for (jack_nframes_t i = 0; i < nframes; i++) {
+	       frames[i].samples[j] = in[i];
+	    }
+	 }
+      }
+
+      jack_buffer.endIncr(nframes);
+   }
+
+   // the engine reads from both buffers, so empties both
+   void clear_engine_side() {
+      jack_buffer.clear();
+      rack_buffer.clear();
+   }
+
+   void clear_jack_side() {}
+};
+
+template <>
+struct jack_to_rack_lane<0> {
+   void set_rates(int, int) {}
+   template <typename F> void read(F) {}
+   size_t backlog() const { return 0; }
+   size_t in_flight() const { return 0; }
+   bool room(jack_nframes_t) const { return true; }
+   void fill(jack_default_audio_sample_t* const*, jack_nframes_t, uint64_t) {}
+   void clear_engine_side() {}
+   void clear_jack_side() {}
+};
+
+/* realtime side; whether a module could exchange a period right now.
+ * a module that sends anything waits until it has a whole period for
+ * jack; a module which only receives waits for room to keep what jack
+ * gives it. */
+template <size_t TO_JACK, size_t FROM_JACK>
+bool period_available(const rack_to_jack_lane<TO_JACK>& to_jack,
+		      const jack_to_rack_lane<FROM_JACK>& from_jack,
+		      jack_nframes_t nframes)
+{
+   return (TO_JACK > 0)
+      ? to_jack.ready(nframes)
+      : from_jack.room(nframes);
+}
+
+/* realtime side; moves one period between a module's lanes and its
+ * ports' buffers, where the TO_JACK outbound ports come first. returns
+ * false if the module was not ready for a period yet. */
+template <size_t TO_JACK, size_t FROM_JACK>
+bool exchange_period(rack_to_jack_lane<TO_JACK>& to_jack,
+		     jack_to_rack_lane<FROM_JACK>& from_jack,
+		     jack_default_audio_sample_t* const* buffers, jack_nframes_t nframes,
+		     uint64_t to_jack_active, uint64_t from_jack_active)
+{
+   if (!period_available(to_jack, from_jack, nframes)) return false;
+
+   to_jack.drain(buffers, nframes, to_jack_active);
+   from_jack.fill(buffers + TO_JACK, nframes, from_jack_active);
+   return true;
+}
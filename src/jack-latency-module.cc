@@ -0,0 +1,228 @@
+#include "jack-latency-module.hh"
+#include "jack-audio-module.hh"
+#include "components.hh"
+
+jack_latency_module::jack_latency_module() : last_sample_rate(0.f) {
+   config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
+   configOutput(SIGNAL_OUTPUT, "Test signal");
+   configInput(RETURN_INPUT, "Test signal, returned");
+}
+
+void jack_latency_module::process(const ProcessArgs &args) {
+   if (args.sampleRate != last_sample_rate) {
+      last_sample_rate = args.sampleRate;
+      meter.restart(args.sampleRate);
+      resolve_divider.setDivision(uint32_t(args.sampleRate / 8));
+   }
+
+   // the same scale our jack modules use, so jack sees what the meter sends
+   float returned = inputs[RETURN_INPUT].getVoltage() / 10.0f;
+   outputs[SIGNAL_OUTPUT].setVoltage(meter.step(returned) * 10.0f);
+
+   if (resolve_divider.process()) meter.resolve();
+}
+
+void jack_latency_module::onReset(const ResetEvent&) {
+   meter.restart(last_sample_rate > 0.f ? last_sample_rate : 48000.f);
+}
+
+/* jack modules wire rack input n to jack port n and rack output n to
+ * the port after every outbound one; for JackPoly, whose cables are
+ * input and output 0, that is the port carrying the first voice, which
+ * is the one a mono cable arrives on. */
+round_trip_estimate round_trip_estimate::of(jack_latency_module* module) {
+   round_trip_estimate estimate = {false, 0.f, 0.f, 0.f};
+   if (!module) return estimate;
+
+   jack_audio_module_base* out = NULL;
+   jack_audio_module_base* in = NULL;
+   size_t out_port = 0, in_port = 0;
+
+   for (int64_t id : APP->engine->getCableIds()) {
+      engine::Cable* cable = APP->engine->getCable(id);
+      if (!cable) continue;
+
+      if (cable->outputModule == module
+	  && cable->outputId == jack_latency_module::SIGNAL_OUTPUT)
+      {
+	 out = dynamic_cast<jack_audio_module_base*>(cable->inputModule);
+	 out_port = cable->inputId;
+      }
+      if (cable->inputModule == module
+	  && cable->inputId == jack_latency_module::RETURN_INPUT)
+      {
+	 in = dynamic_cast<jack_audio_module_base*>(cable->outputModule);
+	 if (in) in_port = in->to_jack_ports + cable->outputId;
+      }
+   }
+
+   if (!out || !in || out_port >= out->to_jack_ports || in_port >= in->jack_ports()) {
+      return estimate;
+   }
+
+   float jack_rate = g_transport.samplerate;
+   float rack_rate = APP->engine->getSampleRate();
+   jack_nframes_t period = g_transport.buffersize;
+   if (jack_rate <= 0.f || rack_rate <= 0.f || period == 0) return estimate;
+
+   /* jack's figures are taken as they are meant for jack_iodelay's: the
+    * playback latency of where the signal goes out plus the capture
+    * latency of where it comes back. looped inside jack, both are zero,
+    * but what goes out in one period still only comes back in the next. */
+   int playback = std::max(out->jport[out_port].latency(), 0);
+   int capture = std::max(in->jport[in_port].latency(), 0);
+   float jack_frames = std::max<float>(playback + capture, period);
+
+   float buffered_frames = out->to_jack_fill.load(std::memory_order_relaxed)
+      + in->from_jack_fill.load(std::memory_order_relaxed);
+
+   // everything counted in jack frames so far
+   float ratio = rack_rate / jack_rate;
+   estimate.valid = true;
+   estimate.buffered = buffered_frames * ratio;
+   estimate.jack = jack_frames * ratio;
+   estimate.cables = 2.f;
+   return estimate;
+}
+
+// stands in for an svg panel, with the readings drawn straight on it
+struct jack_latency_display : public Widget {
+   jack_latency_module* module = NULL;
+   jack_latency_module_widget* master = NULL;
+
+   static void draw_row(NVGcontext* vg, float y, const char* label,
+			const std::string& value, NVGcolor color)
+   {
+      nvgFontSize(vg, 10);
+      nvgFillColor(vg, nvgRGB(0x9a, 0x9a, 0x9a));
+      nvgText(vg, 14, y, label, NULL);
+
+      nvgFontSize(vg, 15);
+      nvgFillColor(vg, color);
+      nvgText(vg, 14, y + 15, value.c_str(), NULL);
+   }
+
+   void draw(const DrawArgs &args) override {
+      NVGcontext* vg = args.vg;
+
+      nvgBeginPath(vg);
+      nvgRect(vg, 0, 0, box.size.x, box.size.y);
+      nvgFillPaint(vg, nvgLinearGradient
+		   (vg, 0, 0, 0, box.size.y,
+		    nvgRGB(0x40, 0x42, 0x45), nvgRGB(0x2e, 0x2f, 0x30)));
+      nvgFill(vg);
+
+      nvgBeginPath(vg);
+      nvgRoundedRect(vg, 8, 40, box.size.x - 16, 166, 5.0);
+      nvgFillColor(vg, nvgRGBA(20, 20, 20, 0xcc));
+      nvgFill(vg);
+
+      std::shared_ptr<Font> font = APP->window->loadFont
+	 (asset::system("res/fonts/ShareTechMono-Regular.ttf"));
+      if (!font || font->handle < 0) return;
+      nvgFontFaceId(vg, font->handle);
+
+      nvgTextAlign(vg, NVG_ALIGN_CENTER | NVG_ALIGN_MIDDLE);
+      nvgFontSize(vg, 13);
+      nvgFillColor(vg, nvgRGB(0xee, 0xee, 0xee));
+      nvgText(vg, box.size.x / 2, 26, "LATENCY", NULL);
+
+      nvgFontSize(vg, 10);
+      nvgText(vg, 31, mm2px(83.f), "SIGNAL", NULL);
+      nvgText(vg, 89, mm2px(83.f), "RETURN", NULL);
+
+      // the module browser's preview has no module
+      if (!module || !master) return;
+
+      nvgTextAlign(vg, NVG_ALIGN_LEFT | NVG_ALIGN_MIDDLE);
+      float rate = APP->engine->getSampleRate();
+      NVGcolor green = nvgRGB(0x2e, 0xcc, 0x71);
+      NVGcolor amber = nvgRGB(0xf3, 0x9c, 0x12);
+
+      int state = module->meter.state.load(std::memory_order_relaxed);
+      float measured = module->meter.delay.load(std::memory_order_relaxed);
+      if (state == round_trip_meter::LOCKED) {
+	 draw_row(vg, 52, "measured", string::f("%.1f", measured), green);
+	 draw_row(vg, 82, "", string::f("%.2f ms", measured * 1e3f / rate), green);
+      } else {
+	 draw_row(vg, 52, "measured",
+		  state == round_trip_meter::QUIET ? "no signal" : "unsure", amber);
+      }
+
+      const round_trip_estimate& expected = master->estimate;
+      if (expected.valid) {
+	 draw_row(vg, 112, "expected", string::f("%.1f", expected.total()), green);
+      } else {
+	 draw_row(vg, 112, "expected", "not patched", amber);
+      }
+
+      if (state == round_trip_meter::LOCKED && expected.valid) {
+	 float off = measured - expected.total();
+	 draw_row(vg, 142, "off by", string::f("%+.1f", off),
+		  std::fabs(off) < 1.f ? green : amber);
+      }
+
+      if (module->meter.inverted.load(std::memory_order_relaxed)) {
+	 draw_row(vg, 172, "", "inverted", amber);
+      }
+   }
+};
+
+jack_latency_module_widget::jack_latency_module_widget(jack_latency_module* module)
+   : estimate(round_trip_estimate::of(module)),
+     estimate_generation(g_jack_client.graph_generation.load(std::memory_order_relaxed))
+{
+   setModule(module);
+   estimate_divider.setDivision(15);
+
+   auto display = createWidget<jack_latency_display>(Vec(0, 0));
+   display->module = module;
+   display->master = this;
+   display->box.size = Vec(8 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT);
+   setPanel(display);
+
+   addChild(createWidget<ThemedScrew>
+	    (Vec(RACK_GRID_WIDTH, 0)));
+   addChild(createWidget<ThemedScrew>
+	    (Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
+   addChild(createWidget<ThemedScrew>
+	    (Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+   addChild(createWidget<ThemedScrew>
+	    (Vec(box.size.x - 2 * RACK_GRID_WIDTH,
+		 RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+
+   addOutput(createOutput<DavidLTPort>
+	     (mm2px(Vec(6.2, 86.0)), module, jack_latency_module::SIGNAL_OUTPUT));
+   addInput(createInput<DavidLTPort>
+	    (mm2px(Vec(25.9, 86.0)), module, jack_latency_module::RETURN_INPUT));
+}
+
+void jack_latency_module_widget::step() {
+   unsigned int generation = g_jack_client.graph_generation.load(std::memory_order_relaxed);
+   if (estimate_divider.process() || generation != estimate_generation) {
+      estimate_generation = generation;
+      estimate = round_trip_estimate::of(getModule<jack_latency_module>());
+   }
+   ModuleWidget::step();
+}
+
+void jack_latency_module_widget::appendContextMenu(Menu* menu) {
+   auto module = getModule<jack_latency_module>();
+   if (!module) return;
+
+   menu->addChild(new MenuSeparator);
+   menu->addChild(createMenuLabel("Expected, in samples"));
+   if (estimate.valid) {
+      menu->addChild(createMenuLabel(string::f("Buffered: %.1f", estimate.buffered)));
+      menu->addChild(createMenuLabel(string::f("JACK: %.1f", estimate.jack)));
+      menu->addChild(createMenuLabel(string::f("Cables: %.0f", estimate.cables)));
+   } else {
+      menu->addChild(createMenuLabel("Patch both ends to JACK modules"));
+   }
+   menu->addChild(createMenuLabel
+		  (string::f("Worst tone error: %.2f",
+			     module->meter.error.load(std::memory_order_relaxed))));
+}
+
+Model* jack_latency_model =
+   createModel<jack_latency_module, jack_latency_module_widget>("JackLatency");
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "skjack.hh"
+#include "round-trip-meter.hh"
+
+/* sends a test signal out, listens for it coming back and says how long
+ * it took, in the manner of jack_iodelay. patch SIGNAL in to one of our
+ * jack modules and RETURN from one, and loop the two ports in jack,
+ * straight or through whatever chain is to be measured. */
+struct jack_latency_module: public Module {
+   enum ParamIds {
+      NUM_PARAMS
+   };
+   enum InputIds {
+      RETURN_INPUT,
+      NUM_INPUTS
+   };
+   enum OutputIds {
+      SIGNAL_OUTPUT,
+      NUM_OUTPUTS
+   };
+   enum LightIds {
+      NUM_LIGHTS
+   };
+
+   round_trip_meter meter;
+
+   // resolving isn't free, and a few times a second is as often as anyone reads it
+   dsp::ClockDivider resolve_divider;
+   float last_sample_rate;
+
+   jack_latency_module();
+
+   void process(const ProcessArgs &args) override;
+   void onReset(const ResetEvent& e) override;
+};
+
+/* what a round trip from SIGNAL to RETURN ought to take by our own
+ * reckoning, in rack samples, made up of:
+ *
+ *   buffered   what the two jack modules hold between rack and jack
+ *   jack       the server's side: whatever jack says lies between the
+ *              two ports, or at least the period a loop inside jack takes
+ *   cables     a sample for each of the two cables in rack
+ *
+ * the resampler's own delay isn't counted, so with rack and jack at
+ * different rates the measurement comes out a little longer. */
+struct round_trip_estimate {
+   // false unless both ends are patched straight to our jack modules
+   bool valid;
+   float buffered;
+   float jack;
+   float cables;
+
+   float total() const { return buffered + jack + cables; }
+
+   static round_trip_estimate of(jack_latency_module* module);
+};
+
+struct jack_latency_module_widget: public ModuleWidget {
+   // kept up to date for the display; ui thread only
+   round_trip_estimate estimate;
+
+   /* walking every cable and asking jack is too much for every frame;
+    * a few times a second will do, and straight away when jack's
+    * connections change */
+   dsp::ClockDivider estimate_divider;
+   unsigned int estimate_generation;
+
+   jack_latency_module_widget(jack_latency_module* module);
+
+   void step() override;
+   void appendContextMenu(Menu* menu) override;
+};
@@ -0,0 +1,174 @@
+#include "jack-module-ports.hh"
+
+#include <algorithm>
+
+/* a channel is only worth moving when both ends are patched. this
+ * is run from the engine thread every few hundred samples; the jack
+ * thread only ever reads the result. */
+void jack_module_ports::refresh_activity() {
+   uint64_t to_active = 0;
+   uint64_t from_active = 0;
+
+   for (size_t i = 0; i < jack_ports(); i++) {
+      if (!rack_side_connected(i) || !jport[i].connected()) continue;
+
+      if (i < to_jack_ports) {
+	 to_active |= uint64_t(1) << i;
+      } else {
+	 from_active |= uint64_t(1) << (i - to_jack_ports);
+      }
+   }
+
+   to_jack_active.store(to_active, std::memory_order_relaxed);
+   from_jack_active.store(from_active, std::memory_order_relaxed);
+}
+
+void jack_module_ports::collect_buffers
+(jack_default_audio_sample_t** buffers, jack_nframes_t nframes)
+{
+   uint64_t from_active = from_jack_active.load(std::memory_order_relaxed);
+
+   for (size_t i = 0; i < to_jack_ports; i++) {
+      buffers[i] = jport[i].get_audio_buffer(nframes);
+   }
+
+   // asking jack for an input's buffer can mean it mixes the port down
+   for (size_t i = 0; i < from_jack_ports; i++) {
+      buffers[to_jack_ports + i] = (from_active & (uint64_t(1) << i))
+	 ? jport[to_jack_ports + i].get_audio_buffer(nframes)
+	 : NULL;
+   }
+}
+
+void jack_module_ports::request_ports() {
+   if (!added || !jack.alive()) return;
+
+   std::unique_lock<std::mutex> lock(port_names_mutex);
+   for (size_t i = 0; i < jack_ports(); i++) {
+      if (jport[i].alive()) continue;
+
+      unsigned int flags =
+	 (i < to_jack_ports ? JackPortIsOutput : JackPortIsInput);
+
+      jack.register_later(jport[i], port_names[i], flags, saved_connections[i]);
+   }
+}
+
+int jack_module_ports::rename_port(size_t port, const std::string& name) {
+   {
+      std::unique_lock<std::mutex> lock(port_names_mutex);
+      port_names[port] = name;
+   }
+
+   // still waiting to be made, or jack isn't up yet
+   if (!jport[port].alive()) {
+      request_ports();
+      return 0;
+   }
+   return jport[port].rename(name);
+}
+
+bool jack_module_ports::refresh_port_names() {
+   bool changed = false;
+
+   std::unique_lock<std::mutex> lock(port_names_mutex);
+   for (size_t i = 0; i < jack_ports(); i++) {
+      unsigned int generation = jport[i].name_generation.load(std::memory_order_acquire);
+      if (generation == seen_name_generations[i]) continue;
+      seen_name_generations[i] = generation;
+
+      std::string name = jport[i].applied_name();
+      if (name.empty() || name == port_names[i]) continue;
+      port_names[i] = name;
+      changed = true;
+   }
+   return changed;
+}
+
+/* engine side; false while there is no jack to talk to, in which case
+ * our outputs have been silenced. the first time through after the
+ * client comes up, asks for our ports to be made. */
+bool jack_module_ports::jack_ready() {
+   unsigned int session = jack.sessions.load(std::memory_order_acquire);
+
+   if (!jack.active()) {
+      if (jack_session != 0) {
+	 jack_session = 0;
+	 on_jack_lost();
+      }
+      return false;
+   }
+
+   if (jack_session != session) {
+      jack_session = session;
+
+      /* ports that were lost with an earlier server still know what
+       * they were connected to; ask for the same again */
+      for (size_t i = 0; i < jack_ports(); i++) {
+	 if (jport[i].alive()) continue;
+	 auto peers = jport[i].peers();
+	 if (!peers.empty()) saved_connections[i] = peers;
+      }
+
+      request_ports();
+   }
+   return true;
+}
+
+void jack_module_ports::on_added() {
+   added = true;
+   request_ports();
+}
+
+/* including what we were asked to restore and couldn't yet, so a patch
+ * saved while a peer is missing doesn't forget about it */
+std::vector<std::string> jack_module_ports::connections_of(size_t port) {
+   std::vector<std::string> peers = jport[port].alive()
+      ? jport[port].peers()
+      : saved_connections[port];
+   for (auto& peer : jack.pending_connections(jport[port])) {
+      if (std::find(peers.begin(), peers.end(), peer) == peers.end())
+	 peers.push_back(peer);
+   }
+   return peers;
+}
+
+// handed off in one go; the client makes them once the whole patch is in
+void jack_module_ports::restore_connections
+(size_t port, const std::vector<std::string>& peers)
+{
+   saved_connections[port] = peers;
+   if (jport[port].alive()) {
+      jack.restore_connections(jport[port], peers);
+   }
+}
+
+jack_module_ports::jack_module_ports
+(jaq::client& jack, jack_transport_hub& hub, size_t to_jack, size_t from_jack)
+   : jack_transport(hub, to_jack, from_jack),
+     jack(jack),
+     jport(new jaq::port[to_jack + from_jack]),
+     port_names(to_jack + from_jack),
+     seen_name_generations(to_jack + from_jack),
+     saved_connections(to_jack + from_jack),
+     added(false), jack_session(0)
+{
+}
+
+jack_module_ports::~jack_module_ports() {
+   // unregister from client
+   globally_unregister();
+
+   /* make sure the client isn't about to make ports for us, or connect
+    * them; jack may be gone, in which case unregistering won't tell it */
+   for (size_t i = 0; i < jack_ports(); i++) {
+      jack.forget_registration(jport[i]);
+      jack.forget_connections(jport[i]);
+   }
+
+   // kill our port
+   if (!jack.alive()) return;
+   for (size_t i = 0; i < jack_ports(); i++) {
+      jport[i].unregister();
+   }
+}
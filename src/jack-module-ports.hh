@@ -0,0 +1,79 @@
+#pragma once
+
+#include "jaq.hh"
+#include "jack-transport.hh"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* a module's jack ports over its life, without rack: asking for them
+ * once the engine has the module, asking again whenever a new server
+ * comes up, which of them have anything to move, and letting them all go
+ * again. jack_audio_module_base is built on it, and so is the soak
+ * test's stand-in, so what gets soaked is what the plugin runs. */
+struct jack_module_ports: public jack_transport {
+   jaq::client& jack;
+
+   std::unique_ptr<jaq::port[]> jport;
+
+   /* what each port is to be registered as. the engine reads these when
+    * it asks for ports, so anyone changing them from elsewhere holds
+    * port_names_mutex */
+   std::vector<std::string> port_names;
+   std::mutex port_names_mutex;
+
+   // each port's name_generation when port_names last caught up with it
+   std::vector<unsigned int> seen_name_generations;
+
+   // jack peers of each port as loaded from the patch; kept so saving
+   // again without a jack server doesn't lose them
+   std::vector<std::vector<std::string>> saved_connections;
+
+   /* set once the engine has us. ports are only registered from then on,
+    * under whatever names we have by that point, so loading a patch
+    * registers each port once rather than registering and renaming. */
+   bool added;
+
+   // the client session our ports were last asked for in
+   unsigned int jack_session;
+
+   // whether the rack end of `port` is in use
+   virtual bool rack_side_connected(size_t port) = 0;
+
+   // engine side; the server has gone, so whatever we put out should stop
+   virtual void on_jack_lost() {}
+
+   void refresh_activity();
+
+   /* jack thread; each port's buffer for this period, outbound ports
+    * first. inbound ports nobody is listening to are left NULL. */
+   void collect_buffers(jack_default_audio_sample_t** buffers, jack_nframes_t nframes);
+
+   void request_ports();
+
+   /* from the ui; `port` is renamed, or made under `name` if it isn't
+    * yet. non-zero if it can't be, though what it ends up called only
+    * turns up later in refresh_port_names() */
+   int rename_port(size_t port, const std::string& name);
+
+   /* takes in to port_names whatever the client actually named our ports
+    * since last time, which needn't be what was asked; true if any of
+    * them changed. from the ui, as rename_port. */
+   bool refresh_port_names();
+   bool jack_ready();
+
+   // the engine has us now; from within its lock, as rack's onAdd
+   void on_added();
+
+   // what `port` is patched to in jack, or was last asked to be
+   std::vector<std::string> connections_of(size_t port);
+
+   // what `port` should be patched to in jack, as a patch says
+   void restore_connections(size_t port, const std::vector<std::string>& peers);
+
+   jack_module_ports(jaq::client& jack, jack_transport_hub& hub,
+		     size_t to_jack, size_t from_jack);
+   virtual ~jack_module_ports();
+};
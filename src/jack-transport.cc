@@ -0,0 +1,205 @@
+#include "jack-transport.hh"
+#include "rt-check.hh"
+#include "trace.hh"
+
+#include <algorithm>
+#include <chrono>
+
+void jack_transport_hub::run_period(jack_nframes_t nframes) {
+   rt_checked realtime;
+   TRACE_THREAD("jack");
+   TRACE_SCOPE("jack period");
+   uint64_t period_started = monotonic_ns();
+   std::unique_lock<std::mutex> lock(modules_mutex);
+
+   /* nobody is listening in real time while we freewheel, so rather
+    * than skipping a period a module isn't ready for, wait for rack to
+    * make it. rack is told to stop at one period ahead (see pace), so
+    * the two take turns. only if rack stops making audio altogether,
+    * say it's paused, do we go on without it: a second for the whole
+    * period, however many modules there are. modules may come and go
+    * meanwhile, so their lock is only held to look at them. */
+   if (freewheeling) {
+      rt_unchecked waiting_on_purpose;
+      lock.unlock();
+      {
+	 auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+	 std::unique_lock<std::mutex> rack_lock(rack_mutex);
+	 rack_cv.wait_until(rack_lock, give_up, [this, nframes]() {
+	    if (!freewheeling) return true;
+	    std::unique_lock<std::mutex> modules_lock(modules_mutex);
+	    for (auto module : modules) {
+	       if (!module->period_ready(nframes)) return false;
+	    }
+	    return true;
+	 });
+      }
+      lock.lock();
+   }
+
+   size_t most_fill = 0;
+   for (auto itr = modules.begin();
+	itr != modules.end();
+	itr++)
+   {
+      auto module = *itr;
+
+      /* each module knows which way its ports face; see the lanes in
+       * jack-lane.hh for what happens to the audio from here. */
+      TRACE_SCOPE("module period");
+      uint64_t started = monotonic_ns();
+      module->on_jack_period(nframes);
+      module->jack_cost.add(float(monotonic_ns() - started));
+      most_fill = std::max(most_fill, module->fill.load(std::memory_order_relaxed));
+   }
+
+   fill.store(most_fill, std::memory_order_relaxed);
+   periods.fetch_add(1, std::memory_order_relaxed);
+   blocked = 0;
+   lock.unlock();
+
+   // waiting on rack while freewheeling isn't load, nor is jack keeping time
+   if (freewheeling) {
+      jack_clock.reset();
+   } else {
+      period_cost.add(float(monotonic_ns() - period_started));
+      jack_nframes_t rate = samplerate;
+      if (rate > 0) jack_clock.tick(period_started, double(nframes) / rate);
+   }
+
+   period_cv.notify_all();
+}
+
+void jack_transport_hub::wake() {
+   period_cv.notify_all();
+}
+
+size_t jack_transport::fill_bucket(size_t fill, jack_nframes_t nframes) {
+   if (nframes == 0) return 0;
+   return fill * 2 / nframes;
+}
+
+// bucket n > 0 holds [2^(n-1), 2^n) microseconds
+size_t jack_transport::stall_bucket(uint64_t ns) {
+   uint64_t us = ns / 1000;
+   size_t bucket = 0;
+   while (us > 0) {
+      us >>= 1;
+      bucket++;
+   }
+   return bucket;
+}
+
+float jack_transport_hub::jack_reported_drift_ppm() const {
+   float usecs = jack_period_usecs;
+   jack_nframes_t frames = buffersize;
+   jack_nframes_t rate = samplerate;
+   if (usecs <= 0.f || frames == 0 || rate == 0) return 0.f;
+   return (frames * 1e6f / rate / usecs - 1.f) * 1e6f;
+}
+
+float jack_transport_hub::period_share(float ns) const {
+   jack_nframes_t frames = buffersize;
+   jack_nframes_t rate = samplerate;
+   if (frames == 0 || rate == 0) return 0.f;
+   return ns * rate / (frames * 1e9f);
+}
+
+jack_transport::jack_transport(jack_transport_hub& hub, size_t to_jack, size_t from_jack)
+   : hub(hub),
+     to_jack_ports(to_jack), from_jack_ports(from_jack),
+     output_latch(),
+     // everything moves until we first get a look at what is patched
+     to_jack_active(~uint64_t(0)), from_jack_active(~uint64_t(0)),
+     engine_meter_tick(0), underruns(0), fill(0), to_jack_fill(0), from_jack_fill(0),
+     rack_clock(false), rack_frames(0),
+     engine_wipe(false), jack_wipe(false)
+{}
+
+jack_transport::~jack_transport() {
+   globally_unregister();
+}
+
+void jack_transport::globally_register() {
+   std::unique_lock<std::mutex> lock(hub.modules_mutex);
+
+   hub.modules.push_back(this);
+   hub.module_count = hub.modules.size();
+
+   /* ensure modules are not filling up their buffers out of sync */
+   for (auto itr = hub.modules.begin();
+	itr != hub.modules.end();
+	itr++)
+   {
+      (*itr)->wipe_buffers();
+   }
+}
+
+void jack_transport::globally_unregister() {
+   std::unique_lock<std::mutex> lock(hub.modules_mutex);
+
+   /* drop ourselves from active module list */
+   auto x = std::find(hub.modules.begin(), hub.modules.end(), this);
+   if (x != hub.modules.end())
+      hub.modules.erase(x);
+   hub.module_count = hub.modules.size();
+}
+
+void jack_transport::wipe_buffers() {
+   engine_wipe = true;
+   jack_wipe = true;
+}
+
+void jack_transport::pace(size_t to_jack_backlog, size_t from_jack_backlog) {
+   /* modules sending audio to jack stall rack once they are too far
+    * ahead; modules only receiving audio stall rack when they are
+    * running low, so jack has a chance to catch up. */
+   // TODO: consider capping this? although an overflow here doesn't cause crashes...
+   size_t target = hub.buffersize * 8;
+
+   /* when freewheeling there is no clock to keep a cushion against; jack
+    * waits for us (see run_period) and we wait for jack, one period at
+    * a time. */
+   if (hub.freewheeling) {
+      target = hub.buffersize;
+      // taken so jack can't miss this between looking and waiting
+      { std::unique_lock<std::mutex> lock(hub.rack_mutex); }
+      hub.rack_cv.notify_all();
+   }
+   if (to_jack_ports > 0) {
+      if (to_jack_backlog > target) {
+	 report_backlogged();
+      }
+   } else {
+      if (from_jack_backlog < target) {
+	 report_backlogged();
+      }
+   }
+}
+
+void jack_transport::report_backlogged() {
+   // we're over half capacity, so set our output latch
+   if (output_latch.try_set()) {
+      hub.blocked++;
+   }
+
+   // if everyone is output latched, stall Rack; but never for good, as
+   // a server going away mid-wait leaves nobody to wake us
+   if (hub.blocked >= hub.module_count && hub.running) {
+      // the engine runs in bursts between stalls
+      TRACE_THREAD("engine");
+      TRACE_END("engine burst");
+      {
+	 TRACE_SCOPE("stall");
+	 uint64_t started = monotonic_ns();
+	 std::unique_lock<std::mutex> lock(jmutex);
+	 hub.period_cv.wait_for(lock, std::chrono::milliseconds(100));
+
+	 uint64_t stalled = monotonic_ns() - started;
+	 hub.stalls.fetch_add(1, std::memory_order_relaxed);
+	 hub.stalled_ns.fetch_add(stalled, std::memory_order_relaxed);
+	 stall_histogram.add(stall_bucket(stalled));
+      }
+      TRACE_BEGIN("engine burst");
+   }
+}
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "clock-estimator.hh"
+#include "cost-meter.hh"
+#include "histogram.hh"
+#include "jack-lane.hh"
+#include "sr-latch.hh"
+
+/* the part of moving audio between rack and jack which needs neither:
+ * the lanes, pacing the engine against jack, and the process callback
+ * walking every module once per period. modules and the benchmarks in
+ * bench/ are both built on it; nothing in here talks to a server or
+ * touches a rack port. */
+
+struct jack_transport;
+
+// what every module taking part in jack's periods shares
+struct jack_transport_hub {
+   /* jack doesn't like us doing things that might block for a "long
+    * time." this is only locked to move a period, and to add or remove
+    * modules, and nobody minds an xrun on those rare occasions. */
+   std::mutex modules_mutex;
+   std::vector<jack_transport*> modules;
+   // how many there are, for those who can't take the lock
+   std::atomic<size_t> module_count;
+
+   // modules which have run ahead of jack since the last period
+   std::atomic<unsigned int> blocked;
+
+   // a period has gone by, or there won't be one for a while
+   std::condition_variable period_cv;
+
+   // rack has made more audio; only signalled while freewheeling
+   std::condition_variable rack_cv;
+   std::mutex rack_mutex;
+
+   /* kept up to date by whoever calls run_period. rack is only ever
+    * stalled while `running`, as otherwise nobody would wake it. */
+   std::atomic<jack_nframes_t> buffersize;
+   std::atomic<jack_nframes_t> samplerate;
+   std::atomic<bool> running;
+   std::atomic<bool> freewheeling;
+
+   // how long run_period takes, every module included
+   cost_meter period_cost;
+
+   /* running totals for watching from outside, e.g. by metrics.hh.
+    * an underrun is a module not having a period ready when jack asked;
+    * the fill is the most frames any module had waiting last period. */
+   std::atomic<unsigned long> periods;
+   std::atomic<unsigned long> underruns;
+   std::atomic<unsigned long> stalls;
+   std::atomic<uint64_t> stalled_ns;
+   std::atomic<size_t> fill;
+
+   // rack's sample rate, as last seen by any module
+   std::atomic<int> rack_rate;
+
+   /* jack's clock against ours, from when each period starts; each
+    * module follows rack's the same way. the difference between the two
+    * is what slowly fills or drains a module's buffer. */
+   clock_estimator jack_clock;
+
+   /* how long jack itself reckons a period takes, in microseconds, if
+    * whoever calls run_period can say (jack_get_cycle_times); else 0 */
+   std::atomic<float> jack_period_usecs;
+
+   jack_transport_hub()
+      : module_count(0), blocked(0), buffersize(0), samplerate(0), running(false), freewheeling(false),
+	periods(0), underruns(0), stalls(0), stalled_ns(0), fill(0), rack_rate(0),
+	jack_clock(true), jack_period_usecs(0.f) {}
+
+   // jack's drift by jack_period_usecs, in ppm; 0 if we don't know it
+   float jack_reported_drift_ppm() const;
+
+   /* how much of a period `ns` is; what jack calls dsp load, if it were
+    * just us. zero while we don't know how long a period is. */
+   float period_share(float ns) const;
+
+   // jack thread; moves one period in to and out of every module
+   void run_period(jack_nframes_t nframes);
+
+   // lets a stalled engine go, e.g. because the server went away
+   void wake();
+};
+
+/* one module's end of the transport. the engine side paces itself
+ * through here once per sample; the hub calls the rest from jack's
+ * thread once per period. */
+struct jack_transport {
+   jack_transport_hub& hub;
+
+   // ports [0, to_jack_ports) are jack outputs fed by rack's inputs,
+   // the remaining from_jack_ports are jack inputs feeding rack's outputs
+   size_t to_jack_ports;
+   size_t from_jack_ports;
+
+   sr_latch output_latch;
+   std::mutex jmutex;
+
+   /* which channels of each lane have something patched on both the
+    * rack and the jack side; bit n is channel n of that lane. written
+    * by the engine thread every so often, read by the jack thread. */
+   std::atomic<uint64_t> to_jack_active;
+   std::atomic<uint64_t> from_jack_active;
+
+   /* what moving our audio costs: on the jack side per period, and on
+    * the engine side per sample. timing every sample would cost about
+    * as much as the sample itself, so only one in ENGINE_METER_EVERY is. */
+   static const unsigned ENGINE_METER_EVERY = 64;
+   cost_meter jack_cost;
+   cost_meter engine_cost;
+   unsigned engine_meter_tick;
+
+   // as the hub's, for this module alone
+   std::atomic<unsigned long> underruns;
+   std::atomic<size_t> fill;
+
+   /* everything each lane held as the last period began, the few frames
+    * on rack's side of the resampler counted as if they were jack's.
+    * together, how far rack's end of the module runs ahead of jack's. */
+   std::atomic<size_t> to_jack_fill;
+   std::atomic<size_t> from_jack_fill;
+
+   /* averages hide what causes dropouts, which is the odd period with
+    * the buffer nearly dry or the odd stall gone long. so: the fill at
+    * every period, in half periods up to ten periods; and how long each
+    * stall took, in doubling steps from under a microsecond up to the
+    * longest we ever wait. see fill_bucket and stall_bucket. */
+   static const size_t FILL_BUCKETS = 21;
+   static const size_t STALL_BUCKETS = 19;
+   histogram<FILL_BUCKETS> fill_histogram;
+   histogram<STALL_BUCKETS> stall_histogram;
+
+   /* the engine's clock, by when each block of RACK_CLOCK_FRAMES frames
+    * goes through. the engine makes audio in bursts, so this is much
+    * noisier than jack's and takes longer to settle. */
+   static const unsigned RACK_CLOCK_FRAMES = 2048;
+   clock_estimator rack_clock;
+   unsigned long rack_frames;
+
+   static size_t fill_bucket(size_t fill, jack_nframes_t nframes);
+   static size_t stall_bucket(uint64_t ns);
+
+   // the fill, in periods, each fill bucket starts at
+   static float fill_bucket_start(size_t bucket) { return bucket * 0.5f; }
+   // the stall, in microseconds, each stall bucket starts at
+   static float stall_bucket_start(size_t bucket) {
+      return bucket == 0 ? 0.f : float(uint32_t(1) << (bucket - 1));
+   }
+
+   inline size_t jack_ports() const {
+      return to_jack_ports + from_jack_ports;
+   }
+
+   // called from the jack thread, with the hub's modules_mutex held,
+   // once per period
+   virtual void on_jack_period(jack_nframes_t nframes) = 0;
+
+   // jack thread; whether on_jack_period would have a period to move
+   virtual bool period_ready(jack_nframes_t nframes) = 0;
+
+   /* asks for our buffers to be emptied, so every module fills up from
+    * the same point. a ring buffer can only safely be emptied by
+    * whoever reads from it, so each side empties its own at its next
+    * step or period; see jack_lanes. */
+   std::atomic<bool> engine_wipe;
+   std::atomic<bool> jack_wipe;
+   void wipe_buffers();
+
+   // join or leave the hub's periods
+   void globally_register();
+   void globally_unregister();
+
+   // stalls rack if jack has fallen behind; give it the backlog of each lane
+   void pace(size_t to_jack_backlog, size_t from_jack_backlog);
+   void report_backlogged();
+
+   jack_transport(jack_transport_hub& hub, size_t to_jack, size_t from_jack);
+   virtual ~jack_transport();
+};
+
+/* both lanes of a module with TO_JACK outbound and FROM_JACK inbound
+ * channels, and what each side does with them every sample or period */
+template <size_t TO_JACK, size_t FROM_JACK>
+struct jack_lanes {
+   rack_to_jack_lane<TO_JACK> to_jack;
+   jack_to_rack_lane<FROM_JACK> from_jack;
+
+   /* engine side, once per rack sample. `scatter` is handed the next
+    * frame from jack, if there is one, and `gather` fills in a frame for
+    * jack; then the engine is held back if it's too far ahead. */
+   template <typename S, typename G>
+   void step(jack_transport& t, int rack_rate, int jack_rate, S scatter, G gather) {
+      bool metered = (++t.engine_meter_tick % jack_transport::ENGINE_METER_EVERY) == 0;
+      uint64_t started = metered ? monotonic_ns() : 0;
+
+      if (t.engine_wipe.load(std::memory_order_relaxed) && t.engine_wipe.exchange(false)) {
+	 to_jack.clear_engine_side();
+	 from_jack.clear_engine_side();
+      }
+
+      from_jack.set_rates(jack_rate, rack_rate);
+      to_jack.set_rates(rack_rate, jack_rate);
+
+      from_jack.read(scatter);
+      to_jack.write(gather);
+
+      // time spent stalled is not time spent working
+      if (metered) {
+	 t.engine_cost.add(float(monotonic_ns() - started));
+	 t.hub.rack_rate.store(rack_rate, std::memory_order_relaxed);
+      }
+
+      // rack isn't keeping time while jack freewheels
+      if (++t.rack_frames % jack_transport::RACK_CLOCK_FRAMES == 0 && rack_rate > 0) {
+	 if (t.hub.freewheeling) {
+	    t.rack_clock.reset();
+	 } else {
+	    t.rack_clock.tick(monotonic_ns(), double(jack_transport::RACK_CLOCK_FRAMES) / rack_rate);
+	 }
+      }
+
+      t.pace(to_jack.backlog(), from_jack.backlog());
+   }
+
+   // realtime side; see period_available
+   bool ready(jack_nframes_t nframes) const {
+      return period_available(to_jack, from_jack, nframes);
+   }
+
+   /* realtime side; `buffers` holds the TO_JACK outbound ports' buffers
+    * followed by the FROM_JACK inbound ones. */
+   void exchange(jack_transport& t, jack_default_audio_sample_t* const* buffers,
+		 jack_nframes_t nframes)
+   {
+      if (t.jack_wipe.load(std::memory_order_relaxed) && t.jack_wipe.exchange(false)) {
+	 to_jack.clear_jack_side();
+	 from_jack.clear_jack_side();
+      }
+
+      // whichever way pace is keeping an eye on
+      size_t fill = TO_JACK > 0 ? to_jack.backlog() : from_jack.backlog();
+      t.fill.store(fill, std::memory_order_relaxed);
+      t.fill_histogram.add(jack_transport::fill_bucket(fill, nframes));
+      t.to_jack_fill.store(to_jack.in_flight(), std::memory_order_relaxed);
+      t.from_jack_fill.store(from_jack.in_flight(), std::memory_order_relaxed);
+
+      if (exchange_period(to_jack, from_jack, buffers, nframes,
+			  t.to_jack_active.load(std::memory_order_relaxed),
+			  t.from_jack_active.load(std::memory_order_relaxed)))
+      {
+	 t.output_latch.reset();
+      } else {
+	 t.underruns.fetch_add(1, std::memory_order_relaxed);
+	 t.hub.underruns.fetch_add(1, std::memory_order_relaxed);
+      }
+   }
+};
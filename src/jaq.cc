@@ -1,4 +1,24 @@
-#include "skjack.hh"
+#include "jaq.hh"
+#include "memory-lock.hh"
+#include "rt-check.hh"
+
+/* only rack's logging; nothing else of rack's is needed here, so the
+ * client can be built in to the tests in test/ without it */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wall"
+#pragma GCC diagnostic ignored "-Wextra"
+#include "logger.hpp"
+#pragma GCC diagnostic pop
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE__) || defined(__x86_64__)
+#include <xmmintrin.h>
+#endif
 
 #ifndef ARCH_WIN
 #include <dlfcn.h>
@@ -26,50 +46,61 @@ namespace jaq {
    int (*client::x_jack_activate)(jack_client_t*);
    jack_port_t* (*client::x_jack_port_by_name)(jack_client_t*, const char *);
    char* (*client::x_jack_get_client_name)(jack_client_t *);
+   int (*client::x_jack_set_port_connect_callback)(jack_client_t*, JackPortConnectCallback, void*);
+   int (*client::x_jack_set_graph_order_callback)(jack_client_t*, JackGraphOrderCallback, void*);
+   int (*client::x_jack_set_port_registration_callback)(jack_client_t*, JackPortRegistrationCallback, void*);
+   jack_port_t* (*client::x_jack_port_by_id)(jack_client_t*, jack_port_id_t);
+   const char** (*client::x_jack_port_get_connections)(const jack_port_t*);
+   void (*client::x_jack_free)(void*);
+   int (*client::x_jack_connect)(jack_client_t*, const char*, const char*);
+   const char* (*client::x_jack_port_name)(const jack_port_t*);
+   int (*client::x_jack_port_flags)(const jack_port_t*);
+   int (*client::x_jack_port_is_mine)(const jack_client_t*, const jack_port_t*);
+   void (*client::x_jack_on_shutdown)(jack_client_t*, JackShutdownCallback, void*);
+   int (*client::x_jack_client_close)(jack_client_t*);
+   int (*client::x_jack_set_freewheel_callback)(jack_client_t*, JackFreewheelCallback, void*);
+   int (*client::x_jack_set_port_rename_callback)(jack_client_t*, JackPortRenameCallback, void*);
+   jack_uuid_t (*client::x_jack_port_uuid)(const jack_port_t*);
+   int (*client::x_jack_set_property)(jack_client_t*, jack_uuid_t, const char*, const char*, const char*);
+   int (*client::x_jack_remove_property)(jack_client_t*, jack_uuid_t, const char*);
+   float (*client::x_jack_cpu_load)(jack_client_t*);
+   int (*client::x_jack_set_xrun_callback)(jack_client_t*, JackXRunCallback, void*);
+   int (*client::x_jack_get_cycle_times)(const jack_client_t*, jack_nframes_t*, jack_time_t*, jack_time_t*, float*);
+   void (*client::x_jack_port_get_latency_range)(jack_port_t*, jack_latency_callback_mode_t, jack_latency_range_t*);
+
+   // JACK_METADATA_PRETTY_NAME from metadata.h; spelled out since we don't link jack
+   static const char* pretty_name_key = "http://jackaudio.org/metadata/pretty-name";
 
    bool port::alive() const {
-      return (mom && mom->alive() && handle);
+      client* m = mom.load(std::memory_order_acquire);
+      return (m && m->alive() && handle);
    }
 
    bool port::register_audio(client& mom, const char* name, unsigned long flags) {
       if (!mom.alive()) return false;
-      this->mom = &mom;
+      if (this->mom != &mom) this->mom = &mom;
       m_flags = flags;
 
       m_output = (flags & JackPortIsOutput) > 0;
 
-      static const size_t buffer_size = 256;
-      char port_name[buffer_size];
-      snprintf
-	 (reinterpret_cast<char*>(&port_name),
-	  buffer_size,
-	  "%s:%s-%s",
-	  client::x_jack_get_client_name(mom.handle),
-	  name,			    // desired port name
-	  m_output ? "out" : "in"); // idiomatic suffix
-
-      auto x = client::x_jack_port_by_name(mom.handle, port_name);
-
-      if (x == NULL) {
-	 snprintf
-	    (reinterpret_cast<char*>(&port_name),
-	     buffer_size,
-	     "%s-%s",
-	     name,		       // desired port name
-	     m_output ? "out" : "in"); // idiomatic suffix
-       DEBUG("Registering : %s", name);
-	 handle = client::x_jack_port_register(
-	    mom.handle,
-	    name,
-	    JACK_DEFAULT_AUDIO_TYPE,
-	    flags,
-	    0);
-      } else return false;
+      // only our own ports can clash with ours, so there's no need to ask jack
+      std::string short_name = mom.claim_name(name, m_output);
+
+      DEBUG("Registering : %s", short_name.c_str());
+      handle = client::x_jack_port_register(
+	 mom.handle,
+	 short_name.c_str(),
+	 JACK_DEFAULT_AUDIO_TYPE,
+	 flags,
+	 0);
 
       if (handle) {
+        set_applied_name(short_name);
+        mom.adopt(this);
         return true;
       }
       else {
+	 mom.release_name(short_name);
 	 this->mom = 0;
 	 return false;
       }
@@ -79,49 +110,606 @@ namespace jaq {
       return m_output;
    }
 
+   std::vector<std::string> port::peers() {
+      client* m = mom.load(std::memory_order_acquire);
+      if (!m) return std::vector<std::string>();
+      std::unique_lock<std::mutex> lock(m->m_ports_mutex);
+      return m_peers;
+   }
+
+   /* these two can be asked from anywhere, and the port can be
+    * unregistered or lose its server meanwhile; so the handle is read
+    * once, and what was read is what's used */
+   std::string port::name() const {
+      jack_port_t* h = handle.load(std::memory_order_acquire);
+      client* m = mom.load(std::memory_order_acquire);
+      if (!h || !m || !m->alive()) return std::string();
+      return client::x_jack_port_name(h);
+   }
+
+   std::string port::applied_name() const {
+      std::unique_lock<std::mutex> lock(m_name_mutex);
+      return m_applied_name;
+   }
+
+   /* an empty name leaves us under the one we had, but still bumps the
+    * generation, so whoever asked for another looks again */
+   void port::set_applied_name(const std::string& short_name) {
+      std::string suffix = m_output ? "-out" : "-in";
+      bool suffixed = short_name.size() > suffix.size()
+	 && short_name.compare(short_name.size() - suffix.size(), suffix.size(), suffix) == 0;
+      if (!short_name.empty()) {
+	 std::unique_lock<std::mutex> lock(m_name_mutex);
+	 m_applied_name = suffixed
+	    ? short_name.substr(0, short_name.size() - suffix.size())
+	    : short_name;
+      }
+      name_generation.fetch_add(1, std::memory_order_release);
+   }
+
+   int port::latency() const {
+      jack_port_t* h = handle.load(std::memory_order_acquire);
+      client* m = mom.load(std::memory_order_acquire);
+      if (!h || !m || !m->alive() || !client::x_jack_port_get_latency_range) return -1;
+
+      jack_latency_range_t range;
+      client::x_jack_port_get_latency_range
+	 (h, m_output ? JackPlaybackLatency : JackCaptureLatency, &range);
+      return int(range.max);
+   }
+
+   void port::refresh_connections() {
+      m_peers.clear();
+
+      if (handle) {
+	 const char** names = client::x_jack_port_get_connections(handle);
+	 if (names) {
+	    for (size_t i = 0; names[i] != NULL; i++) {
+	       m_peers.push_back(names[i]);
+	    }
+	    client::x_jack_free(names);
+	 }
+      }
+
+      m_connections.store(m_peers.size(), std::memory_order_relaxed);
+   }
+
    int port::rename(const std::string& new_name) {
       if (!alive()) return -99;
 
-      static const size_t buffer_size = 256;
-      char port_name[buffer_size];
-      snprintf
-	 (reinterpret_cast<char*>(&port_name),
-	  buffer_size,
-	  "%s:%s-%s",
-	  client::x_jack_get_client_name(mom->handle),
-	  new_name.c_str(),	    // current port name
-	  m_output ? "out" : "in"); // idiomatic suffix
-      auto x = client::x_jack_port_by_name(mom->handle, port_name);
-      if (x == NULL) {
-   	  snprintf
-   	    (reinterpret_cast<char*>(&port_name),
-   	     buffer_size,
-   	     "%s-%s",
-   	     new_name.c_str(),	    // desired port name
-   	     m_output ? "out" : "in"); // idiomatic suffix
-        //DEBUG("Rename %s", new_name.c_str());
-        // Rename isn't working for reasons I don't understand.
-	     //int ret = client::x_jack_port_rename(mom->handle, handle, new_name.c_str());
-        //return ret;
-        client::x_jack_port_unregister(mom->handle, handle);
-        handle = client::x_jack_port_register(
-           mom->handle,
-           port_name,
-           JACK_DEFAULT_AUDIO_TYPE,
-           m_flags,
-           0);
-        if (handle == NULL) {
-         return -98;
-        } else {
-         return 0;
-        }
-      }
-      else 
-	 return -97; // Make this obvious
+      client::port_command command;
+      command.what = client::port_command::RENAME;
+      command.handle = handle;
+      command.name = new_name;
+      mom.load()->post(command);
+      return 0;
    }
 
    void port::unregister() {
-      if (alive()) client::x_jack_port_unregister(mom->handle, handle);
+      if (!alive()) return;
+
+      /* forget the port before jack does, so a callback arriving during
+       * the unregister does not find us half gone */
+      client* m = mom.load();
+      m->abandon(this);
+
+      client::port_command command;
+      command.what = client::port_command::RETIRE;
+      command.handle = handle.exchange(nullptr);
+      m_connections.store(0, std::memory_order_relaxed);
+      m->post(command);
+   }
+
+   void client::post(port_command command) {
+      command.session = sessions.load(std::memory_order_acquire);
+      m_commands.push(command);
+
+      // taken only so the worker can't miss the wakeup between looking
+      // at the queue and going to sleep
+      { std::unique_lock<std::mutex> lock(m_lifecycle_mutex); }
+      m_lifecycle_cv.notify_one();
+   }
+
+   void client::lifecycle_main() {
+      std::unique_lock<std::mutex> lock(m_lifecycle_mutex);
+      while (!m_quitting) {
+	 if (m_commands.empty()) {
+	    m_lifecycle_cv.wait_for(lock, std::chrono::milliseconds(100));
+	    continue;
+	 }
+
+	 lock.unlock();
+	 unsigned int session = sessions.load(std::memory_order_acquire);
+	 std::vector<jack_port_t*> retiring;
+	 {
+	    std::unique_lock<std::mutex> server(m_server_mutex);
+	    m_commands.drain([this, session, &retiring](port_command& command) {
+	       // ports from before a server restart went with that server
+	       if (command.session != session) {
+		  if (m_pretty_session != session) m_pretty_named.clear();
+		  m_pretty_session = session;
+		  return;
+	       }
+
+	       switch (command.what) {
+	       case port_command::RENAME:
+		  rename_now(command.handle, command.name);
+		  break;
+	       case port_command::RETIRE:
+		  if (command.handle) retiring.push_back(command.handle);
+		  break;
+	       }
+	    });
+	 }
+
+	 // a whole module's ports go together, e.g. when it is deleted
+	 if (!retiring.empty()) retire_now(retiring, session);
+	 lock.lock();
+      }
+   }
+
+   /* renames in place, so everything connected to the port stays
+    * connected. a jack without jack_port_rename, or one which refuses,
+    * gets the new name as the port's pretty-name instead; it keeps its
+    * old name underneath but that's what people see. */
+   void client::rename_now(jack_port_t* port, const std::string& new_name) {
+      if (!handle) return;
+
+      bool output = (x_jack_port_flags(port) & JackPortIsOutput) != 0;
+      std::string old_name = short_name_of(port);
+      if (old_name == new_name + (output ? "-out" : "-in")) return;
+
+      std::string short_name = claim_name(new_name, output);
+      auto pretty = std::find(m_pretty_named.begin(), m_pretty_named.end(), port);
+
+      if (x_jack_port_rename && x_jack_port_rename(handle, port, short_name.c_str()) == 0) {
+	 release_name(old_name);
+	 name_applied(port, short_name);
+
+	 // an old pretty-name would hide the name we just took
+	 if (pretty != m_pretty_named.end()) {
+	    if (x_jack_port_uuid && x_jack_remove_property) {
+	       x_jack_remove_property(handle, x_jack_port_uuid(port), pretty_name_key);
+	    }
+	    m_pretty_named.erase(pretty);
+	 }
+	 return;
+      }
+
+      // the port keeps its old name after all
+      release_name(short_name);
+
+      if (x_jack_port_uuid && x_jack_set_property) {
+	 int error = x_jack_set_property
+	    (handle, x_jack_port_uuid(port), pretty_name_key, short_name.c_str(), "text/plain");
+	 if (error == 0) {
+	    if (pretty == m_pretty_named.end()) m_pretty_named.push_back(port);
+	    name_applied(port, short_name);
+	    return;
+	 }
+      }
+
+      DEBUG("Changing port name failed: %s", short_name.c_str());
+      // so whoever asked stops showing a name we never got
+      name_applied(port, std::string());
+   }
+
+   void client::name_applied(jack_port_t* handle, const std::string& short_name) {
+      std::unique_lock<std::mutex> lock(m_ports_mutex);
+      for (auto p : m_ports) {
+	 if (p->handle == handle) p->set_applied_name(short_name);
+      }
+   }
+
+   /* `wanted` with our usual -in/-out suffix, or if one of our ports
+    * already has that, the first free of `wanted`-2, `wanted`-3... the
+    * name is ours until it is released. */
+   std::string client::claim_name(const std::string& wanted, bool output) {
+      const char* suffix = output ? "-out" : "-in";
+
+      std::unique_lock<std::mutex> lock(m_names_mutex);
+      std::string name = wanted + suffix;
+      for (int n = 2; m_names.count(name); n++) {
+	 name = wanted + "-" + std::to_string(n) + suffix;
+      }
+      m_names.insert(name);
+      return name;
+   }
+
+   void client::release_name(const std::string& short_name) {
+      std::unique_lock<std::mutex> lock(m_names_mutex);
+      m_names.erase(short_name);
+   }
+
+   std::string client::short_name_of(jack_port_t* port) {
+      // everything after "client:"
+      return std::string(x_jack_port_name(port) + strlen(x_jack_get_client_name(handle)) + 1);
+   }
+
+   void client::retire_now(const std::vector<jack_port_t*>& ports, unsigned int session) {
+      /* the realtime thread may have picked the ports up just before
+       * they were cleared, so wait for the cycle it did so in to finish;
+       * once for all of them, and without keeping anyone else off the
+       * server meanwhile. a client that isn't running any cycles isn't
+       * using them either. */
+      unsigned long seen = m_cycles.load(std::memory_order_acquire);
+      auto give_up = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+      while (m_cycles.load(std::memory_order_acquire) == seen
+	     && std::chrono::steady_clock::now() < give_up
+	     && !m_quitting)
+      {
+	 std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+
+      std::unique_lock<std::mutex> server(m_server_mutex);
+      // the server may have gone while we waited, and the ports with it
+      if (!handle || sessions.load(std::memory_order_acquire) != session) return;
+
+      for (auto port : ports) {
+	 std::string name = short_name_of(port);
+	 x_jack_port_unregister(handle, port);
+	 release_name(name);
+
+	 auto pretty = std::find(m_pretty_named.begin(), m_pretty_named.end(), port);
+	 if (pretty != m_pretty_named.end()) m_pretty_named.erase(pretty);
+      }
+   }
+
+   void client::activate() {
+      if (!handle || active()) return;
+      if (x_jack_activate(handle) != 0) return;
+
+      sessions.fetch_add(1, std::memory_order_release);
+      m_active.store(true, std::memory_order_release);
+   }
+
+   // bytes of stack touched before the first cycle
+   static const size_t stack_prefault_size = 64 * 1024;
+
+   /* and has them locked in, if that's wanted; the pages stay ours for
+    * as long as the thread runs, so what's locked is always stack the
+    * thread may yet use. once a session, so the lock can wait. */
+   __attribute__((noinline)) static void prefault_stack() {
+      char pages[stack_prefault_size];
+      memset(pages, 0, sizeof(pages));
+      // or the compiler sees nobody reads it and skips the lot
+      __asm__ __volatile__("" : : "r"(pages) : "memory");
+
+      rt_unchecked once_a_session;
+      memory_lock::set_stack(pages, sizeof(pages));
+   }
+
+   // denormals turn up in decaying tails and are very slow to work with
+   static bool flush_denormals() {
+#if defined(__SSE__) || defined(__x86_64__)
+      _mm_setcsr(_mm_getcsr() | 0x8040); // FTZ | DAZ
+      return true;
+#elif defined(__aarch64__)
+      uint64_t fpcr;
+      __asm__ __volatile__("mrs %0, fpcr" : "=r"(fpcr));
+      fpcr |= (uint64_t(1) << 24); // FZ
+      __asm__ __volatile__("msr fpcr, %0" : : "r"(fpcr));
+      return true;
+#else
+      return false;
+#endif
+   }
+
+   /* once per session, on the thread jack will run us on, before it does
+    * anything else; these are all settings of the thread itself. */
+   void client::prepare_realtime_thread() {
+      rt_denormals_flushed.store(flush_denormals(), std::memory_order_relaxed);
+      prefault_stack();
+      rt_stack_prefaulted.store(stack_prefault_size, std::memory_order_relaxed);
+   }
+
+   // the client can't go away during a period, so no locking needed
+   float client::period_usecs() {
+      jack_client_t* h = handle.load(std::memory_order_relaxed);
+      if (!x_jack_get_cycle_times || !h) return 0.f;
+
+      jack_nframes_t frames;
+      jack_time_t current, next;
+      float usecs;
+      if (x_jack_get_cycle_times(h, &frames, &current, &next, &usecs) != 0) return 0.f;
+      return usecs;
+   }
+
+   /* only asks if nobody else is talking to the server, as whoever
+    * wants to know is usually drawing something */
+   float client::cpu_load() {
+      if (!x_jack_cpu_load) return -1.f;
+
+      std::unique_lock<std::mutex> server(m_server_mutex, std::try_to_lock);
+      if (!server.owns_lock() || !handle) return -1.f;
+      return x_jack_cpu_load(handle);
+   }
+
+   int client::on_jack_process(jack_nframes_t nframes, void* arg) {
+      auto self = reinterpret_cast<client*>(arg);
+      rt_checked realtime;
+
+      unsigned int session = self->sessions.load(std::memory_order_relaxed);
+      if (self->m_prepared_session != session) {
+	 self->m_prepared_session = session;
+	 self->prepare_realtime_thread();
+      }
+
+      int result = self->m_process ? self->m_process(nframes, self->m_process_arg) : 0;
+      self->m_cycles.fetch_add(1, std::memory_order_release);
+      return result;
+   }
+
+   void client::adopt(port* p) {
+      std::unique_lock<std::mutex> lock(m_ports_mutex);
+      if (std::find(m_ports.begin(), m_ports.end(), p) == m_ports.end()) {
+	 m_ports.push_back(p);
+      }
+      p->refresh_connections();
+      graph_generation++;
+   }
+
+   void client::abandon(port* p) {
+      {
+	 std::unique_lock<std::mutex> lock(m_ports_mutex);
+	 auto x = std::find(m_ports.begin(), m_ports.end(), p);
+	 if (x != m_ports.end()) m_ports.erase(x);
+	 graph_generation++;
+      }
+
+      // nothing should be connected to a port once it's gone
+      forget_connections(*p);
+   }
+
+   void client::forget_connections(port& p) {
+      std::unique_lock<std::mutex> lock(m_pending_mutex);
+      auto mine = [&p](const pending_connection& c) { return c.mine == &p; };
+      m_pending.erase(std::remove_if(m_pending.begin(), m_pending.end(), mine),
+		      m_pending.end());
+      m_unresolved.erase(std::remove_if(m_unresolved.begin(), m_unresolved.end(), mine),
+			 m_unresolved.end());
+      if (m_batch_out) m_abandoned_meanwhile.push_back(&p);
+   }
+
+   void client::restore_connections(port& p, const std::vector<std::string>& peers) {
+      if (peers.empty()) return;
+
+      std::unique_lock<std::mutex> lock(m_pending_mutex);
+      for (auto& peer : peers) {
+	 pending_connection c;
+	 c.mine = &p;
+	 c.peer = peer;
+	 m_pending.push_back(c);
+      }
+      m_requests++;
+      m_pending_cv.notify_all();
+   }
+
+   std::vector<std::string> client::pending_connections(port& p) {
+      std::vector<std::string> result;
+      std::unique_lock<std::mutex> lock(m_pending_mutex);
+      for (auto& c : m_pending) {
+	 if (c.mine == &p) result.push_back(c.peer);
+      }
+      for (auto& c : m_unresolved) {
+	 if (c.mine == &p) result.push_back(c.peer);
+      }
+      return result;
+   }
+
+   void client::register_later(port& p, const std::string& name, unsigned long flags,
+				const std::vector<std::string>& peers)
+   {
+      /* the port is ours from here on; the connector only ever finds it
+       * already set */
+      p.mom.store(this, std::memory_order_release);
+
+      pending_registration r;
+      r.mine = &p;
+      r.name = name;
+      r.flags = flags;
+      r.peers = peers;
+
+      std::unique_lock<std::mutex> lock(m_pending_mutex);
+      // asking again before the first went through only updates it
+      auto x = std::find_if(m_registrations.begin(), m_registrations.end(),
+			    [&p](const pending_registration& q) { return q.mine == &p; });
+      if (x != m_registrations.end()) *x = r;
+      else m_registrations.push_back(r);
+
+      m_requests++;
+      m_pending_cv.notify_all();
+   }
+
+   void client::forget_registration(port& p) {
+      {
+	 std::unique_lock<std::mutex> lock(m_pending_mutex);
+	 m_registrations.erase
+	    (std::remove_if(m_registrations.begin(), m_registrations.end(),
+			    [&p](const pending_registration& q) { return q.mine == &p; }),
+	     m_registrations.end());
+      }
+
+      // the worker may have taken it already; wait until it's done with it
+      std::unique_lock<std::mutex> registering(m_registering_mutex);
+   }
+
+   bool client::registration_pending(port& p) {
+      std::unique_lock<std::mutex> lock(m_pending_mutex);
+      return std::find_if(m_registrations.begin(), m_registrations.end(),
+			  [&p](const pending_registration& q) { return q.mine == &p; })
+	 != m_registrations.end();
+   }
+
+   /* a patch loads one module at a time, and the peers a module wants
+    * are often ports of modules further along in the patch. so rather
+    * than registering and connecting as requests come in, we wait for
+    * them to stop coming for a moment and then do all of them at once. */
+   void client::connector_main() {
+      static const auto settle_time = std::chrono::milliseconds(250);
+
+      std::unique_lock<std::mutex> lock(m_pending_mutex);
+      while (!m_quitting) {
+	 if (m_pending.empty() && m_registrations.empty()) {
+	    m_pending_cv.wait(lock);
+	    continue;
+	 }
+
+	 // keep waiting while more requests trickle in
+	 unsigned long seen = m_requests;
+	 m_pending_cv.wait_for(lock, settle_time);
+	 if (m_quitting) break;
+	 if (m_requests != seen) continue;
+
+	 // held while we own ports' registrations, see forget_registration
+	 lock.unlock();
+	 std::unique_lock<std::mutex> registering(m_registering_mutex);
+	 std::unique_lock<std::mutex> server(m_server_mutex);
+	 lock.lock();
+
+	 std::vector<pending_connection> batch;
+	 std::vector<pending_registration> registrations;
+	 batch.swap(m_pending);
+	 registrations.swap(m_registrations);
+	 m_batch_out = true;
+	 lock.unlock();
+
+	 for (auto& r : registrations) {
+	    if (!r.mine->register_audio(*this, r.name.c_str(), r.flags)) {
+	       DEBUG("Registering %s failed", r.name.c_str());
+	       continue;
+	    }
+	    for (auto& peer : r.peers) {
+	       pending_connection c;
+	       c.mine = r.mine;
+	       c.peer = peer;
+	       batch.push_back(c);
+	    }
+	 }
+	 registering.unlock();
+
+	 connect_batch(batch);
+	 server.unlock();
+	 lock.lock();
+
+	 // whatever could not be made waits for its peer to show up
+	 auto gone = [this](const pending_connection& c) {
+	    return std::find(m_abandoned_meanwhile.begin(), m_abandoned_meanwhile.end(), c.mine)
+	       != m_abandoned_meanwhile.end();
+	 };
+	 batch.erase(std::remove_if(batch.begin(), batch.end(), gone), batch.end());
+	 if (m_batch_lost) batch.clear();
+	 m_abandoned_meanwhile.clear();
+	 m_batch_out = false;
+	 m_batch_lost = false;
+	 m_unresolved.insert(m_unresolved.end(), batch.begin(), batch.end());
+      }
+   }
+
+   // makes what it can of `batch`, leaving behind what could not be made
+   void client::connect_batch(std::vector<pending_connection>& batch) {
+      if (!alive()) return;
+
+      struct wanted {
+	 std::string source;
+	 std::string destination;
+	 pending_connection request;
+      };
+      std::vector<wanted> todo;
+
+      // decide what is needed while our ports can't go anywhere...
+      {
+	 std::unique_lock<std::mutex> lock(m_ports_mutex);
+	 for (auto& c : batch) {
+	    if (std::find(m_ports.begin(), m_ports.end(), c.mine) == m_ports.end())
+	       continue;
+	    if (std::find(c.mine->m_peers.begin(), c.mine->m_peers.end(), c.peer)
+		!= c.mine->m_peers.end())
+	       continue;
+
+	    wanted w;
+	    std::string mine = x_jack_port_name(c.mine->handle);
+	    w.source = c.mine->is_output() ? mine : c.peer;
+	    w.destination = c.mine->is_output() ? c.peer : mine;
+	    w.request = c;
+	    todo.push_back(w);
+	 }
+      }
+
+      // ...then talk to the server without holding anything
+      batch.clear();
+      for (auto& w : todo) {
+	 int error = x_jack_connect(handle, w.source.c_str(), w.destination.c_str());
+	 if (error != 0 && error != EEXIST) {
+	    batch.push_back(w.request);
+	 }
+      }
+   }
+
+   /* the callbacks below run on jack's notification thread. they only
+    * ever read our own ports' connections, which jack keeps on the
+    * client side, so they don't wait on the server. */
+
+   void client::on_jack_port_connect(jack_port_id_t a, jack_port_id_t b, int, void* dptr) {
+      auto self = reinterpret_cast<client*>(dptr);
+      jack_port_t* pa = x_jack_port_by_id(self->handle, a);
+      jack_port_t* pb = x_jack_port_by_id(self->handle, b);
+
+      std::unique_lock<std::mutex> lock(self->m_ports_mutex);
+      for (auto p : self->m_ports) {
+	 if (p->handle == pa || p->handle == pb) p->refresh_connections();
+      }
+      self->graph_generation++;
+   }
+
+   // peers remember us by name, so anyone connected to a renamed port looks again
+   void client::on_jack_port_rename(jack_port_id_t, const char*, const char*, void* dptr) {
+      on_jack_graph_order(dptr);
+   }
+
+   int client::on_jack_graph_order(void* dptr) {
+      auto self = reinterpret_cast<client*>(dptr);
+
+      std::unique_lock<std::mutex> lock(self->m_ports_mutex);
+      for (auto p : self->m_ports) p->refresh_connections();
+      self->graph_generation++;
+      return 0;
+   }
+
+   /* a port going away anywhere takes its connections to us with it; a
+    * new one might be a peer somebody asked us to connect to. */
+   void client::on_jack_port_registration(jack_port_id_t id, int reg, void* dptr) {
+      auto self = reinterpret_cast<client*>(dptr);
+
+      if (!reg) {
+	 on_jack_graph_order(dptr);
+	 return;
+      }
+
+      /* we claim names before registering, so this should already know
+       * it. notifications come late, though, and one for a port we have
+       * since retired must not take back the name retiring let go of;
+       * so only a port one of ours still holds counts. */
+      jack_port_t* p = x_jack_port_by_id(self->handle, id);
+      if (p && x_jack_port_is_mine(self->handle, p)) {
+	 std::string name = self->short_name_of(p);
+	 std::unique_lock<std::mutex> ports(self->m_ports_mutex);
+	 bool held = std::find_if(self->m_ports.begin(), self->m_ports.end(),
+				  [p](port* q) { return q->handle == p; })
+	    != self->m_ports.end();
+	 if (held) {
+	    std::unique_lock<std::mutex> lock(self->m_names_mutex);
+	    self->m_names.insert(name);
+	 }
+      }
+
+      std::unique_lock<std::mutex> lock(self->m_pending_mutex);
+      if (self->m_unresolved.empty()) return;
+      self->m_pending.insert(self->m_pending.end(),
+			     self->m_unresolved.begin(),
+			     self->m_unresolved.end());
+      self->m_unresolved.clear();
+      self->m_pending_cv.notify_all();
    }
 
    int client::on_jack_buffer_size(jack_nframes_t nframes, void* dptr) {
@@ -147,6 +735,19 @@ namespace jaq {
 #endif
 
    bool client::link() {
+      /* somebody wants us talking to a stand-in, like the fake jack in
+       * test/; if that won't load we don't go looking for a real one */
+      const char* stand_in = getenv("STKJACK_LIBJACK");
+      if (stand_in && *stand_in) {
+	 lib = dlopen(stand_in, RTLD_LAZY);
+	 if (!lib) {
+	    WARN("STKJACK_LIBJACK is set, but %s won't load", stand_in);
+	    return false;
+	 }
+	 INFO("Using %s in place of JACK", stand_in);
+	 goto linked;
+      }
+
       lib = dlopen("libjack" PARTY_HAT_SUFFIX, RTLD_LAZY);
 
 #ifndef ARCH_WIN
@@ -155,7 +756,7 @@ namespace jaq {
 	 lib = dlopen("/usr/lib/libjack" PARTY_HAT_SUFFIX, RTLD_LAZY);
 	 if (!lib) {
 	    WARN("/usr/lib/libjack" PARTY_HAT_SUFFIX " was not found either");
-	    lib = dlopen("/usr/lib/libjack" PARTY_HAT_SUFFIX, RTLD_LAZY);
+	    lib = dlopen("/usr/local/lib/libjack" PARTY_HAT_SUFFIX, RTLD_LAZY);
 #endif
 	    if (!lib) {
 #ifndef ARCH_WIN
@@ -171,6 +772,7 @@ namespace jaq {
 
       INFO("We linked to JACK :^)");
 
+     linked:
 #define knab(y, z) x_##y = reinterpret_cast<z>(dlsym(lib, #y)); if (!x_##y) { WARN("Could not find " #y " in your JACK."); goto goddamnit; }
 
       knab(jack_client_open, jack_client_t* (*)(const char*, unsigned long, jack_status_t*));
@@ -179,16 +781,42 @@ namespace jaq {
       knab(jack_set_buffer_size_callback, int (*)(jack_client_t*, JackBufferSizeCallback, void*));
       knab(jack_set_sample_rate_callback, int (*)(jack_client_t*, JackSampleRateCallback, void*));
       knab(jack_set_process_callback, int (*)(jack_client_t*, JackProcessCallback, void*));
-      knab(jack_port_rename, int (*)(jack_client_t*, jack_port_t*, const char*));
       knab(jack_port_unregister, int (*)(jack_client_t*, jack_port_t*));
       knab(jack_port_register, jack_port_t* (*)(jack_client_t*, const char*, const char*, unsigned long, unsigned long));
       knab(jack_port_get_buffer, void* (*)(jack_port_t*, jack_nframes_t));
       knab(jack_activate, int (*)(jack_client_t*));
       knab(jack_port_by_name, jack_port_t* (*)(jack_client_t*, const char *));
       knab(jack_get_client_name, char* (*)(jack_client_t *));
+      knab(jack_set_port_connect_callback, int (*)(jack_client_t*, JackPortConnectCallback, void*));
+      knab(jack_set_graph_order_callback, int (*)(jack_client_t*, JackGraphOrderCallback, void*));
+      knab(jack_set_port_registration_callback, int (*)(jack_client_t*, JackPortRegistrationCallback, void*));
+      knab(jack_port_by_id, jack_port_t* (*)(jack_client_t*, jack_port_id_t));
+      knab(jack_port_get_connections, const char** (*)(const jack_port_t*));
+      knab(jack_free, void (*)(void*));
+      knab(jack_connect, int (*)(jack_client_t*, const char*, const char*));
+      knab(jack_port_name, const char* (*)(const jack_port_t*));
+      knab(jack_port_flags, int (*)(const jack_port_t*));
+      knab(jack_port_is_mine, int (*)(const jack_client_t*, const jack_port_t*));
+      knab(jack_on_shutdown, void (*)(jack_client_t*, JackShutdownCallback, void*));
+      knab(jack_client_close, int (*)(jack_client_t*));
+      knab(jack_set_freewheel_callback, int (*)(jack_client_t*, JackFreewheelCallback, void*));
 
 #undef knab
 
+#define knab_maybe(y, z) x_##y = reinterpret_cast<z>(dlsym(lib, #y)); if (!x_##y) { INFO("Your JACK has no " #y "; doing without."); }
+
+      knab_maybe(jack_port_rename, int (*)(jack_client_t*, jack_port_t*, const char*));
+      knab_maybe(jack_set_port_rename_callback, int (*)(jack_client_t*, JackPortRenameCallback, void*));
+      knab_maybe(jack_port_uuid, jack_uuid_t (*)(const jack_port_t*));
+      knab_maybe(jack_set_property, int (*)(jack_client_t*, jack_uuid_t, const char*, const char*, const char*));
+      knab_maybe(jack_remove_property, int (*)(jack_client_t*, jack_uuid_t, const char*));
+      knab_maybe(jack_cpu_load, float (*)(jack_client_t*));
+      knab_maybe(jack_set_xrun_callback, int (*)(jack_client_t*, JackXRunCallback, void*));
+      knab_maybe(jack_get_cycle_times, int (*)(const jack_client_t*, jack_nframes_t*, jack_time_t*, jack_time_t*, float*));
+      knab_maybe(jack_port_get_latency_range, void (*)(jack_port_t*, jack_latency_callback_mode_t, jack_latency_range_t*));
+
+#undef knab_maybe
+
       return true;
 
      goddamnit:
@@ -201,19 +829,187 @@ namespace jaq {
       if (handle) return true;
 
       jack_status_t jstatus;
-      handle = x_jack_client_open("VCV Rack", JackNoStartServer, &jstatus);
-      if (!handle) return false;
+      jack_client_t* h = x_jack_client_open("VCV Rack", JackNoStartServer, &jstatus);
+      if (!h) return false;
 
-      buffersize_max = x_jack_get_buffer_size(handle);
-      buffersize = x_jack_get_buffer_size(handle);
-      samplerate = x_jack_get_sample_rate(handle);
+      buffersize_max = x_jack_get_buffer_size(h);
+      buffersize = x_jack_get_buffer_size(h);
+      samplerate = x_jack_get_sample_rate(h);
 
-      x_jack_set_buffer_size_callback(handle, &on_jack_buffer_size, this);
-      x_jack_set_sample_rate_callback(handle, &on_jack_sample_rate, this);
+      x_jack_set_buffer_size_callback(h, &on_jack_buffer_size, this);
+      x_jack_set_sample_rate_callback(h, &on_jack_sample_rate, this);
+      x_jack_set_port_connect_callback(h, &on_jack_port_connect, this);
+      x_jack_set_graph_order_callback(h, &on_jack_graph_order, this);
+      x_jack_set_port_registration_callback(h, &on_jack_port_registration, this);
+      if (x_jack_set_port_rename_callback) {
+	 x_jack_set_port_rename_callback(h, &on_jack_port_rename, this);
+      }
 
+      x_jack_on_shutdown(h, &on_jack_shutdown, this);
+      x_jack_set_freewheel_callback(h, &on_jack_freewheel, this);
+      if (x_jack_set_xrun_callback) {
+	 x_jack_set_xrun_callback(h, &on_jack_xrun, this);
+      }
+      if (m_process) x_jack_set_process_callback(h, &on_jack_process, this);
+
+      // other threads may be watching for us; only now is there something to see
+      handle = h;
       return true;
    }
 
+   /* the server has gone; called from one of jack's threads, so all we
+    * do is say so. the supervisor does the cleaning up. */
+   void client::on_jack_shutdown(void* dptr) {
+      auto self = reinterpret_cast<client*>(dptr);
+      self->m_active.store(false, std::memory_order_release);
+      self->m_freewheeling.store(false, std::memory_order_relaxed);
+
+      {
+	 std::unique_lock<std::mutex> lock(self->m_supervisor_mutex);
+	 self->m_server_gone = true;
+      }
+      self->m_supervisor_cv.notify_all();
+      if (self->m_on_shutdown) self->m_on_shutdown(self->m_on_shutdown_arg);
+   }
+
+   void client::on_jack_freewheel(int starting, void* dptr) {
+      auto self = reinterpret_cast<client*>(dptr);
+      self->m_freewheeling.store(starting != 0, std::memory_order_relaxed);
+   }
+
+   int client::on_jack_xrun(void* dptr) {
+      auto self = reinterpret_cast<client*>(dptr);
+      self->xruns.fetch_add(1, std::memory_order_relaxed);
+      return 0;
+   }
+
+   void client::run(JackProcessCallback cb, void* user,
+		    void (*on_shutdown)(void*), void* shutdown_user)
+   {
+      if (m_supervisor.joinable()) return;
+
+      m_process = cb;
+      m_process_arg = user;
+      m_on_shutdown = on_shutdown;
+      m_on_shutdown_arg = shutdown_user;
+
+      m_connector = std::thread(&client::connector_main, this);
+      m_lifecycle = std::thread(&client::lifecycle_main, this);
+      m_supervisor = std::thread(&client::supervisor_main, this);
+   }
+
+   /* keeps us connected. opens the client to begin with, and whenever
+    * the server goes away cleans up after it and keeps trying to open a
+    * new one, waiting a little longer after each failure. */
+   void client::supervisor_main() {
+      static const auto shortest_wait = std::chrono::milliseconds(500);
+      static const auto longest_wait = std::chrono::milliseconds(8000);
+
+      if (!link()) return;
+
+      auto wait = shortest_wait;
+      std::unique_lock<std::mutex> lock(m_supervisor_mutex);
+      while (!m_quitting) {
+	 if (active() && !m_server_gone) {
+	    m_supervisor_cv.wait(lock);
+	    continue;
+	 }
+
+	 if (m_server_gone) {
+	    m_server_gone = false;
+	    lock.unlock();
+	    WARN("JACK went away; will keep trying to get it back");
+	    forget_server();
+	    lock.lock();
+	 }
+
+	 lock.unlock();
+	 bool opened = open();
+	 if (opened) activate();
+	 lock.lock();
+
+	 if (opened && active()) {
+	    INFO("Connected to JACK");
+	    wait = shortest_wait;
+	    continue;
+	 }
+
+	 // a client that won't activate is no use; start over with a new one
+	 if (opened) {
+	    lock.unlock();
+	    forget_server();
+	    lock.lock();
+	 }
+
+	 m_supervisor_cv.wait_for(lock, wait);
+	 wait = std::min(wait * 2, longest_wait);
+      }
+   }
+
+   /* everything we had in the old server is gone. ports forget their
+    * handles but keep who they were connected to, and who they were
+    * still waiting on, so their modules can ask for the same again once
+    * there is a new server. nothing else about a port is kept: a module
+    * deleted meanwhile can't tell us, and another port may come to live
+    * where it did. */
+   void client::forget_server() {
+      std::unique_lock<std::mutex> server(m_server_mutex);
+
+      jack_client_t* h = handle.exchange(nullptr);
+      if (h) x_jack_client_close(h);
+
+      {
+	 std::unique_lock<std::mutex> lock(m_ports_mutex);
+	 std::unique_lock<std::mutex> pending(m_pending_mutex);
+
+	 for (auto* list : {&m_pending, &m_unresolved}) {
+	    for (auto& c : *list) {
+	       if (std::find(m_ports.begin(), m_ports.end(), c.mine) == m_ports.end())
+		  continue;
+	       auto& peers = c.mine->m_peers;
+	       if (std::find(peers.begin(), peers.end(), c.peer) == peers.end())
+		  peers.push_back(c.peer);
+	    }
+	    list->clear();
+	 }
+	 if (m_batch_out) m_batch_lost = true;
+
+	 for (auto p : m_ports) {
+	    p->handle = nullptr;
+	    p->m_connections.store(0, std::memory_order_relaxed);
+	 }
+	 m_ports.clear();
+	 graph_generation++;
+      }
+
+      m_pretty_named.clear();
+
+      std::unique_lock<std::mutex> lock(m_names_mutex);
+      m_names.clear();
+   }
+
+   client::~client() {
+      {
+	 std::unique_lock<std::mutex> lock(m_pending_mutex);
+	 m_quitting = true;
+	 m_pending_cv.notify_all();
+      }
+      if (m_connector.joinable()) m_connector.join();
+
+      { std::unique_lock<std::mutex> lock(m_lifecycle_mutex); }
+      m_lifecycle_cv.notify_all();
+      if (m_lifecycle.joinable()) m_lifecycle.join();
+
+      { std::unique_lock<std::mutex> lock(m_supervisor_mutex); }
+      m_supervisor_cv.notify_all();
+      if (m_supervisor.joinable()) m_supervisor.join();
+
+      /* jack would otherwise go on calling our process callback, and
+       * whatever it uses, for as long as the process lasts; closing
+       * waits for the cycle under way to finish */
+      forget_server();
+   }
+
    bool client::close() {
       if (lib) {
 #if 0
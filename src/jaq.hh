@@ -7,16 +7,28 @@
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Weverything"
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 #include "jack/jack.h"
+#include "jack/metadata.h"
 
 // re-entering our zone of concern
 #pragma GCC diagnostic pop
 #pragma clang diagnostic pop
 
+#include "command-queue.hh"
+
 namespace jaq {
+  struct port;
+
   struct client {
-    jack_client_t* handle; // handle to our jack client
+    // handle to our jack client; set once the client is fully set up
+    std::atomic<jack_client_t*> handle;
 
     static void* lib; // handle to the jack library
     static jack_nframes_t (*x_jack_get_buffer_size)(jack_client_t*);
@@ -32,46 +44,269 @@ namespace jaq {
     static int (*x_jack_activate)(jack_client_t*);
     static jack_port_t* (*x_jack_port_by_name)(jack_client_t*, const char *);
     static char* (*x_jack_get_client_name)(jack_client_t *);
+    static int (*x_jack_set_port_connect_callback)(jack_client_t*, JackPortConnectCallback, void*);
+    static int (*x_jack_set_graph_order_callback)(jack_client_t*, JackGraphOrderCallback, void*);
+    static int (*x_jack_set_port_registration_callback)(jack_client_t*, JackPortRegistrationCallback, void*);
+    static jack_port_t* (*x_jack_port_by_id)(jack_client_t*, jack_port_id_t);
+    static const char** (*x_jack_port_get_connections)(const jack_port_t*);
+    static void (*x_jack_free)(void*);
+    static int (*x_jack_connect)(jack_client_t*, const char*, const char*);
+    static const char* (*x_jack_port_name)(const jack_port_t*);
+    static int (*x_jack_port_flags)(const jack_port_t*);
+    static int (*x_jack_port_is_mine)(const jack_client_t*, const jack_port_t*);
+    static void (*x_jack_on_shutdown)(jack_client_t*, JackShutdownCallback, void*);
+    static int (*x_jack_client_close)(jack_client_t*);
+    static int (*x_jack_set_freewheel_callback)(jack_client_t*, JackFreewheelCallback, void*);
+
+    // not in every jack; these are left NULL where they are missing
+    static int (*x_jack_set_port_rename_callback)(jack_client_t*, JackPortRenameCallback, void*);
+    static jack_uuid_t (*x_jack_port_uuid)(const jack_port_t*);
+    static int (*x_jack_set_property)(jack_client_t*, jack_uuid_t, const char*, const char*, const char*);
+    static int (*x_jack_remove_property)(jack_client_t*, jack_uuid_t, const char*);
+    static float (*x_jack_cpu_load)(jack_client_t*);
+    static int (*x_jack_set_xrun_callback)(jack_client_t*, JackXRunCallback, void*);
+    static int (*x_jack_get_cycle_times)(const jack_client_t*, jack_nframes_t*, jack_time_t*, jack_time_t*, float*);
+    static void (*x_jack_port_get_latency_range)(jack_port_t*, jack_latency_callback_mode_t, jack_latency_range_t*);
 
     static bool link(); // try to dynamically link to jack
 
-    // these are publicly read-only; we do keep them updated via callbacks though
-    jack_nframes_t buffersize_max;
-    jack_nframes_t buffersize;
-    jack_nframes_t samplerate;
+    /* these are publicly read-only; we do keep them updated via callbacks
+     * though, and a new server sets them afresh while the engine reads */
+    std::atomic<jack_nframes_t> buffersize_max;
+    std::atomic<jack_nframes_t> buffersize;
+    std::atomic<jack_nframes_t> samplerate;
+
+    /* bumped whenever the connections of any of our ports may have
+     * changed; anyone caching what the ports are wired to can compare
+     * it to decide if they need to look again. */
+    std::atomic<unsigned int> graph_generation;
 
     bool open(); // create the jack client
     bool close(); // destroy the jack client
 
     inline bool alive() const { return handle != 0; }
 
-    inline void activate() {
-      if (handle) x_jack_activate(handle);
-    }
+    // alive and running process cycles
+    inline bool active() const { return m_active.load(std::memory_order_acquire); }
 
-    inline void set_process_callback(JackProcessCallback cb, void* user) {
-      if (handle) x_jack_set_process_callback(handle, cb, user);
-    }
+    /* jack is running cycles as fast as it can rather than in real time,
+     * e.g. for a DAW rendering its output. the process callback may
+     * block while this is so. */
+    inline bool freewheeling() const { return m_freewheeling.load(std::memory_order_relaxed); }
+
+    /* bumped each time the client is activated. anything made in jack
+     * through an earlier session has to be made again. */
+    std::atomic<unsigned int> sessions;
+
+    void activate();
+
+    // how jack's realtime thread was prepared, for diagnostics
+    std::atomic<bool> rt_denormals_flushed;
+    std::atomic<size_t> rt_stack_prefaulted;
+
+    // xruns jack has told us about, across every server we've had
+    std::atomic<unsigned long> xruns;
+
+    /* realtime thread only; how long jack reckons a period takes, from
+     * its own smoothing of when they start. 0 if jack can't say. */
+    float period_usecs();
+
+    /* the server's dsp load in percent, every client included; negative
+     * if jack can't tell us, or is busy with us right now */
+    float cpu_load();
+
+    /* links to jack and keeps a client open and active from a thread of
+     * our own, opening a new one whenever the server goes away and comes
+     * back. `cb` is our process callback; `on_shutdown` is told from
+     * one of jack's threads whenever we lose the server. */
+    void run(JackProcessCallback cb, void* user,
+	     void (*on_shutdown)(void*), void* shutdown_user);
+
+    /* asks for `p` to be connected to each of `peers` (full jack port
+     * names). nothing happens right away; requests from every port are
+     * collected until they stop arriving and then made in one pass on a
+     * background thread. peers which don't exist yet are tried again
+     * whenever a new port appears in jack. */
+    void restore_connections(port& p, const std::vector<std::string>& peers);
+
+    // peers asked for by restore_connections which aren't connected yet
+    std::vector<std::string> pending_connections(port& p);
 
-    client() : handle(0) {}
+    /* asks for `p` to be registered as `name`, then connected to
+     * `peers`. registrations are batched on the same background thread
+     * as restore_connections, so a patch's worth of ports is made in one
+     * go once it is known what they are called. asking again for a port
+     * still waiting replaces the earlier request. */
+    void register_later(port& p, const std::string& name, unsigned long flags,
+			const std::vector<std::string>& peers);
+
+    // drops a waiting registration; once this returns `p` will not be
+    // registered behind our back, so it may be unregistered and freed
+    void forget_registration(port& p);
+
+    // drops whatever connections `p` is still waiting on, whether or not
+    // it exists; for a port about to be freed
+    void forget_connections(port& p);
+
+    bool registration_pending(port& p);
+
+    client()
+      : handle(nullptr), buffersize_max(0), buffersize(0), samplerate(0),
+	graph_generation(0), sessions(0),
+	rt_denormals_flushed(false), rt_stack_prefaulted(0), xruns(0),
+	m_requests(0), m_batch_out(false), m_batch_lost(false), m_quitting(false),
+	m_process(0), m_process_arg(0), m_cycles(0), m_active(false), m_freewheeling(false),
+	m_pretty_session(0),
+	m_on_shutdown(0), m_on_shutdown_arg(0), m_server_gone(false),
+	m_prepared_session(0) {}
+    ~client();
 
   private:
     client(const client&) {/*don't copy that floppy*/}
 
+    friend struct port;
+
+    // every port registered through us, so callbacks can find them
+    std::mutex m_ports_mutex;
+    std::vector<port*> m_ports;
+
+    void adopt(port* p);
+    void abandon(port* p);
+
+    /* short names of our own ports, suffix and all. jack won't let two
+     * of our ports share a name, so checking here is as good as asking
+     * the server and a great deal quicker. */
+    std::mutex m_names_mutex;
+    std::unordered_set<std::string> m_names;
+
+    std::string claim_name(const std::string& wanted, bool output);
+    void release_name(const std::string& short_name);
+    std::string short_name_of(jack_port_t* port);
+
+    // tells whichever of our ports has `handle` what it's now called
+    void name_applied(jack_port_t* handle, const std::string& short_name);
+
+    struct pending_connection {
+      port* mine;
+      std::string peer;
+    };
+
+    struct pending_registration {
+      port* mine;
+      std::string name;
+      unsigned long flags;
+      std::vector<std::string> peers;
+    };
+
+    // connections waiting to be made, and ones waiting on a peer to exist
+    std::mutex m_pending_mutex;
+    std::condition_variable m_pending_cv;
+    std::vector<pending_connection> m_pending;
+    std::vector<pending_connection> m_unresolved;
+    std::vector<pending_registration> m_registrations;
+    unsigned long m_requests;
+
+    /* ports abandoned while the connector had a batch out; whatever is
+     * left of the batch for them is dropped, not kept for later, as
+     * another port may be living at the same address by then */
+    bool m_batch_out;
+    std::vector<port*> m_abandoned_meanwhile;
+    // the server went with a batch out; none of it is kept
+    bool m_batch_lost;
+    std::mutex m_registering_mutex;
+    std::atomic<bool> m_quitting;
+    std::thread m_connector;
+
+    void connector_main();
+    void connect_batch(std::vector<pending_connection>& batch);
+
+    JackProcessCallback m_process;
+    void* m_process_arg;
+
+    // process cycles finished so far; lets us tell when the realtime
+    // thread can no longer be holding on to an old port
+    std::atomic<unsigned long> m_cycles;
+
+    std::atomic<bool> m_active;
+    std::atomic<bool> m_freewheeling;
+
+    /* renames and unregistrations are not done by whoever asks for them
+     * but by a thread of their own. ports are told apart by their jack
+     * handle, so a port object may go away as soon as it has asked. */
+    struct port_command {
+      enum { RENAME, RETIRE } what;
+      jack_port_t* handle;
+      std::string name;
+      unsigned int session;
+    };
+
+    command_queue<port_command> m_commands;
+    std::mutex m_lifecycle_mutex;
+    std::condition_variable m_lifecycle_cv;
+    std::thread m_lifecycle;
+
+    // ports showing a pretty-name instead of their own; server mutex
+    std::vector<jack_port_t*> m_pretty_named;
+    unsigned int m_pretty_session;
+
+    void post(port_command command);
+    void lifecycle_main();
+    void rename_now(jack_port_t* port, const std::string& new_name);
+    void retire_now(const std::vector<jack_port_t*>& ports, unsigned int session);
+
+    static int on_jack_process(jack_nframes_t nframes, void* arg);
+
+    // held by whoever is talking to the server through `handle`, so it
+    // isn't closed out from under them
+    std::mutex m_server_mutex;
+
+    void (*m_on_shutdown)(void*);
+    void* m_on_shutdown_arg;
+
+    std::mutex m_supervisor_mutex;
+    std::condition_variable m_supervisor_cv;
+    bool m_server_gone;
+    std::thread m_supervisor;
+
+    void supervisor_main();
+    void forget_server();
+    static void on_jack_shutdown(void* arg);
+    static void on_jack_freewheel(int starting, void* arg);
+    static int on_jack_xrun(void* arg);
+
+    // realtime thread only
+    unsigned int m_prepared_session;
+    void prepare_realtime_thread();
+
     static int on_jack_buffer_size(jack_nframes_t nframes, void* arg);
     static int on_jack_sample_rate(jack_nframes_t nframes, void* arg);
+    static void on_jack_port_connect(jack_port_id_t a, jack_port_id_t b, int connect, void* arg);
+    static int on_jack_graph_order(void* arg);
+    static void on_jack_port_registration(jack_port_id_t id, int reg, void* arg);
+    static void on_jack_port_rename(jack_port_id_t id, const char* old_name, const char* new_name, void* arg);
   };
 
   struct port {
-    client* mom;
-    jack_port_t* handle;
+    /* set when the port is first asked for, which the engine may do
+     * while somebody else asks if it's alive */
+    std::atomic<client*> mom;
+
+    /* only ever replaced whole, so the realtime thread sees either a
+     * working port or none at all. a port is cleared here before it is
+     * unregistered, and unregistered only once the realtime thread has
+     * finished the cycle it might have been using it in. */
+    std::atomic<jack_port_t*> handle;
 
     bool m_output;
     unsigned long m_flags;
 
     //std::string m_current_name;
 
-    port() : mom(0), handle(0) {}
+    /* bumped each time we are registered or renamed, whether or not
+     * we got the name asked for; see applied_name() */
+    std::atomic<unsigned int> name_generation;
+
+    port() : mom(0), handle(nullptr), name_generation(0), m_connections(0) {}
 
     bool alive() const;
 
@@ -81,19 +316,66 @@ namespace jaq {
 
     bool is_output() const;
 
+    /* how many jack ports we are connected to. kept up to date by the
+     * client's callbacks and safe to read from any thread, including the
+     * realtime one. */
+    inline int connection_count() const {
+      return m_connections.load(std::memory_order_relaxed);
+    }
+
+    // true if anything in jack is connected to this port
+    inline bool connected() const {
+      return connection_count() > 0;
+    }
+
+    // full names of the ports we are connected to, as last seen
+    std::vector<std::string> peers();
+
+    // our own full name, client name included
+    std::string name() const;
+
+    /* frames jack reckons lie between us and the outside world: for an
+     * output, until what we write is heard; for an input, since what we
+     * read was captured. the worst case, or -1 if jack can't say. */
+    int latency() const;
+
     // returns port memory as an array of samples; `samples` should match
     // whatever you recieved via the `nsamples` parameter
     inline jack_default_audio_sample_t* get_audio_buffer(jack_nframes_t nframes) {
-      if (alive())
+      jack_port_t* h = handle.load(std::memory_order_acquire);
+      client* m = mom.load(std::memory_order_acquire);
+      if (h && m && m->alive())
         return reinterpret_cast<jack_default_audio_sample_t*>(
-          client::x_jack_port_get_buffer(handle, nframes));
+          client::x_jack_port_get_buffer(h, nframes));
 
       return NULL;
     }
 
+    // asks the client to rename us in the background; fails right away
+    // only if we don't exist
     int rename(const std::string& new_name);
 
+    /* the name we were last registered or renamed under, without the
+     * -in/-out; numbered if another of ours had it first, or the old one
+     * if jack wouldn't rename us. empty until we are first registered. */
+    std::string applied_name() const;
+
   private:
     port(const port&) {/*don't ocopy that floppy*/}
+
+    friend struct client;
+
+    // guarded by the client's port mutex
+    std::vector<std::string> m_peers;
+    std::atomic<int> m_connections;
+
+    mutable std::mutex m_name_mutex;
+    std::string m_applied_name;
+
+    // from whichever client thread registered or renamed us
+    void set_applied_name(const std::string& short_name);
+
+    // re-reads our connections from jack; client's port mutex must be held
+    void refresh_connections();
   };
 }
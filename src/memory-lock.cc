@@ -0,0 +1,133 @@
+#include "memory-lock.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#ifndef ARCH_WIN
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+namespace memory_lock {
+   namespace {
+      struct region {
+	 const void* start;
+	 size_t size;
+	 bool locked;
+      };
+
+      std::mutex g_mutex;
+      std::vector<region> g_regions;
+      region g_stack = {nullptr, 0, false};
+      bool g_enabled = false;
+      size_t g_locked = 0;
+      int g_error = 0;
+
+#ifndef ARCH_WIN
+      // what the kernel counts against the limit: every page it touches
+      size_t pages_of(const region& r) {
+	 uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	 uintptr_t first = (uintptr_t)r.start & ~(page - 1);
+	 uintptr_t last = ((uintptr_t)r.start + r.size + page - 1) & ~(page - 1);
+	 return last - first;
+      }
+
+      // how much more we may lock; root isn't held to the limit
+      size_t allowance() {
+	 struct rlimit limit;
+	 if (getrlimit(RLIMIT_MEMLOCK, &limit) != 0) return 0;
+	 if (limit.rlim_cur == RLIM_INFINITY || geteuid() == 0) return SIZE_MAX;
+	 return limit.rlim_cur > g_locked ? limit.rlim_cur - g_locked : 0;
+      }
+
+      // g_mutex must be held
+      void pin(region& r) {
+	 if (r.locked || !r.start) return;
+
+	 size_t size = pages_of(r);
+	 if (size > allowance()) {
+	    g_error = ENOMEM;
+	    return;
+	 }
+	 if (mlock(r.start, r.size) != 0) {
+	    g_error = errno;
+	    return;
+	 }
+	 r.locked = true;
+	 g_locked += size;
+      }
+
+      // g_mutex must be held
+      void unpin(region& r) {
+	 if (!r.locked) return;
+	 munlock(r.start, r.size);
+	 r.locked = false;
+	 g_locked -= pages_of(r);
+      }
+#else
+      void pin(region& r) {
+	 if (!r.locked && r.start) g_error = ENOSYS;
+      }
+
+      void unpin(region&) {}
+#endif
+   }
+
+   bool enable(bool on) {
+      std::unique_lock<std::mutex> lock(g_mutex);
+      g_enabled = on;
+      g_error = 0;
+
+      for (auto& r : g_regions) {
+	 if (on) pin(r);
+	 else unpin(r);
+      }
+      if (on) pin(g_stack);
+      else unpin(g_stack);
+      return g_error == 0;
+   }
+
+   bool enabled() {
+      std::unique_lock<std::mutex> lock(g_mutex);
+      return g_enabled;
+   }
+
+   size_t locked() {
+      std::unique_lock<std::mutex> lock(g_mutex);
+      return g_locked;
+   }
+
+   int error() {
+      std::unique_lock<std::mutex> lock(g_mutex);
+      return g_error;
+   }
+
+   void add(const void* start, size_t size) {
+      std::unique_lock<std::mutex> lock(g_mutex);
+      region r = {start, size, false};
+      if (g_enabled) pin(r);
+      g_regions.push_back(r);
+   }
+
+   void remove(const void* start, size_t size) {
+      std::unique_lock<std::mutex> lock(g_mutex);
+      auto x = std::find_if(g_regions.begin(), g_regions.end(), [=](const region& r) {
+	 return r.start == start && r.size == size;
+      });
+      if (x == g_regions.end()) return;
+      unpin(*x);
+      g_regions.erase(x);
+   }
+
+   void set_stack(const void* start, size_t size) {
+      std::unique_lock<std::mutex> lock(g_mutex);
+      unpin(g_stack);
+      g_stack.start = start;
+      g_stack.size = size;
+      if (g_enabled) pin(g_stack);
+   }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+
+/* keeps what jack's realtime thread touches in ram, so it never waits on
+ * a page coming back from swap: every lane's buffers, and the stack the
+ * thread prefaults before its first period. only these, rather than the
+ * whole of rack with mlockall, as the locked memory limit is usually a
+ * few MiB at most and everything else rack allocates would start
+ * failing once we had used it up.
+ *
+ * regions are registered whether or not locking is on, and locked as
+ * they come or once it is turned on. a region is left unlocked if it
+ * would take us over RLIMIT_MEMLOCK; error() then says so. */
+namespace memory_lock {
+   // turns locking on or off for everything registered; false if it
+   // couldn't all be locked, in which case what could be is
+   bool enable(bool on);
+   bool enabled();
+
+   // bytes locked right now
+   size_t locked();
+
+   // why the last region failed to lock, as an errno; 0 if none did
+   int error();
+
+   // a region of ours which lives at least until it is removed
+   void add(const void* start, size_t size);
+   void remove(const void* start, size_t size);
+
+   /* the realtime thread's prefaulted stack, replacing the last thread's;
+    * from that thread, so it is only ever the stack it is running on */
+   void set_stack(const void* start, size_t size);
+}
@@ -0,0 +1,106 @@
+#include "metrics.hh"
+#include "skjack.hh"
+
+#include <chrono>
+#include <cstring>
+
+#ifdef ARCH_LIN
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static void publish(stkjack_metrics* m) {
+   // we are the only writer, so nothing else moves it meanwhile
+   uint32_t sequence = m->sequence.load(std::memory_order_relaxed);
+   m->sequence.store(sequence + 1, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_release);
+
+   m->updated_ms = std::chrono::duration_cast<std::chrono::milliseconds>
+      (std::chrono::system_clock::now().time_since_epoch()).count();
+
+   m->xruns = g_jack_client.xruns.load(std::memory_order_relaxed);
+   m->periods = g_transport.periods.load(std::memory_order_relaxed);
+   m->underruns = g_transport.underruns.load(std::memory_order_relaxed);
+   m->stalls = g_transport.stalls.load(std::memory_order_relaxed);
+   m->stalled_ns = g_transport.stalled_ns.load(std::memory_order_relaxed);
+
+   m->jack_running = g_jack_client.active() ? 1 : 0;
+   m->buffersize = g_transport.buffersize;
+   m->jack_rate = g_transport.samplerate;
+   m->rack_rate = g_transport.rack_rate.load(std::memory_order_relaxed);
+   m->fill_frames = g_transport.fill.load(std::memory_order_relaxed);
+   m->callback_ns = g_transport.period_cost.average();
+   m->callback_peak_ns = g_transport.period_cost.peak();
+   m->dsp_load = g_jack_client.cpu_load();
+   m->jack_clock_settled = g_transport.jack_clock.settled ? 1 : 0;
+   m->jack_drift_ppm = g_transport.jack_clock.drift_ppm;
+   m->jack_jitter_us = g_transport.jack_clock.jitter_us;
+
+   m->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+void metrics_exporter::run() {
+   std::string path = STKJACK_METRICS_PREFIX + std::to_string(getpid());
+
+   int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) {
+      WARN("Could not create %s: %s", path.c_str(), strerror(errno));
+      return;
+   }
+
+   void* mapped = MAP_FAILED;
+   if (ftruncate(fd, sizeof(stkjack_metrics)) == 0) {
+      mapped = mmap(NULL, sizeof(stkjack_metrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   }
+   close(fd);
+   if (mapped == MAP_FAILED) {
+      WARN("Could not map %s: %s", path.c_str(), strerror(errno));
+      unlink(path.c_str());
+      return;
+   }
+
+   auto m = reinterpret_cast<stkjack_metrics*>(mapped);
+   m->version = STKJACK_METRICS_VERSION;
+   m->pid = getpid();
+   // readers only trust a file once this is there
+   std::atomic_thread_fence(std::memory_order_release);
+   m->magic = STKJACK_METRICS_MAGIC;
+   INFO("Publishing metrics to %s", path.c_str());
+
+   std::unique_lock<std::mutex> lock(m_mutex);
+   while (!m_quitting) {
+      publish(m);
+      m_cv.wait_for(lock, std::chrono::seconds(1));
+   }
+
+   munmap(mapped, sizeof(stkjack_metrics));
+   unlink(path.c_str());
+}
+
+#else
+
+void metrics_exporter::run() {
+   WARN("Metrics are only published on Linux");
+}
+
+#endif
+
+void metrics_exporter::enable(bool enabled) {
+   if (enabled == this->enabled()) return;
+
+   if (enabled) {
+      m_thread = std::thread(&metrics_exporter::run, this);
+   } else {
+      stop();
+   }
+}
+
+void metrics_exporter::stop() {
+   {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_quitting = true;
+   }
+   m_cv.notify_all();
+   if (m_thread.joinable()) m_thread.join();
+   m_quitting = false;
+}
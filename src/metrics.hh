@@ -0,0 +1,88 @@
+#pragma once
+
+/* our counters, published to a small file in /dev/shm for watching a
+ * rack from another process; tools/stkjack-metrics.cc reads them back.
+ * linux only. each rack writes its own file, named after its pid,
+ * about once a second from a thread of its own, and takes it away
+ * again when it quits.
+ *
+ * the layout is shared with readers built separately, so only ever add
+ * to the end of it, and bump the version if anything else changes. */
+
+#include <atomic>
+#include <cstdint>
+
+#define STKJACK_METRICS_PREFIX "/dev/shm/stkjack-"
+#define STKJACK_METRICS_MAGIC 0x4d4a4b53 // "SKJM"
+#define STKJACK_METRICS_VERSION 1
+
+struct stkjack_metrics {
+   uint32_t magic;
+   uint32_t version;
+
+   /* odd while the writer is part way through; a reader wanting a
+    * consistent copy waits for it to be even and the same either side
+    * of reading. the writer stores it with release and readers load it
+    * with acquire, so what they copy in between is what it covers */
+   std::atomic<uint32_t> sequence;
+   uint32_t pid;
+
+   // unix time, in milliseconds, of the last update
+   uint64_t updated_ms;
+
+   // totals since rack started
+   uint64_t xruns;
+   uint64_t periods;
+   uint64_t underruns;
+   uint64_t stalls;
+   uint64_t stalled_ns;
+
+   // as of the last update
+   uint32_t jack_running;
+   uint32_t buffersize;
+   uint32_t jack_rate;
+   uint32_t rack_rate;
+   uint32_t fill_frames;
+   float callback_ns;
+   float callback_peak_ns;
+   // jack's own, in percent; negative if jack won't say
+   float dsp_load;
+
+   // jack's clock against ours; not worth reading until settled
+   uint32_t jack_clock_settled;
+   float jack_drift_ppm;
+   float jack_jitter_us;
+};
+
+// shared between processes, so no locks and no change to the layout
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "sequence must be lock free");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+	      "sequence must stay a plain 32 bits");
+
+#ifndef STKJACK_METRICS_READER
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/* publishes while enabled. stops when destroyed, so it should be
+ * destroyed before whatever it publishes the numbers of. */
+struct metrics_exporter {
+   // rack's gui thread only
+   void enable(bool enabled);
+   bool enabled() const { return m_thread.joinable(); }
+
+   metrics_exporter() : m_quitting(false) {}
+   ~metrics_exporter() { stop(); }
+
+private:
+   std::mutex m_mutex;
+   std::condition_variable m_cv;
+   bool m_quitting;
+   std::thread m_thread;
+
+   void run();
+   void stop();
+};
+
+#endif
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+/* measures how long what we send takes to come back, to a fraction of a
+ * sample, the way jack_iodelay does (Fons Adriaensen's multi-tone delay
+ * measurement). thirteen tones go out together and each is listened for
+ * in what returns. the phase the first comes back with gives the delay
+ * within one of its sixteen sample cycles; each of the others, sitting
+ * a little off a multiple of it, gives one more bit of how many whole
+ * cycles, for up to 65536 samples in all.
+ *
+ * the engine steps it once per sample and resolves it every so often;
+ * anybody may read what it found. */
+struct round_trip_meter {
+   static const int TONES = 13;
+
+   enum state_t {
+      QUIET,   // too little of the first tone is coming back
+      UNSURE,  // coming back, but the tones don't agree on a delay
+      LOCKED
+   };
+
+   std::atomic<int> state;
+   // in samples; only meaningful while LOCKED
+   std::atomic<float> delay;
+   // the worst any tone missed by, where half means it told us nothing
+   std::atomic<float> error;
+   // whatever is in the way flips the signal over
+   std::atomic<bool> inverted;
+
+   round_trip_meter()
+      : state(QUIET), delay(0.f), error(0.f), inverted(false) {
+      restart(48000.f);
+   }
+
+   // listening begins over; the filters are tuned to the sample rate
+   void restart(float samplerate) {
+      static const uint32_t steps[TONES] = {
+	 4096, 2048, 3072, 2560, 2304, 2176, 1088,
+	 1312, 1552, 1800, 3332, 3586, 3841
+      };
+
+      for (int i = 0; i < TONES; i++) {
+	 tone& t = m_tones[i];
+	 t.step = steps[i];
+	 t.phase = 128;
+	 t.xa = t.ya = t.xf = t.yf = 0.f;
+      }
+      m_lowpass = 200.f / samplerate;
+      m_count = 0;
+      m_inverted = false;
+      state.store(QUIET, std::memory_order_relaxed);
+   }
+
+   // engine thread; takes the sample which came back, gives the next to send
+   float step(float returned) {
+      float out = 0.f;
+      for (int i = 0; i < TONES; i++) {
+	 tone& t = m_tones[i];
+	 float a = float(TWO_PI / 65536.0) * (t.phase & 65535);
+	 t.phase += t.step;
+	 float c = std::cos(a);
+	 float s = -std::sin(a);
+	 out += (i ? 0.01f : 0.2f) * s;
+	 t.xa += s * returned;
+	 t.ya += c * returned;
+      }
+
+      // correlations are summed over one cycle of the first tone at a time
+      if (++m_count == 16) {
+	 for (int i = 0; i < TONES; i++) {
+	    tone& t = m_tones[i];
+	    t.xf += m_lowpass * (t.xa - t.xf + 1e-20f);
+	    t.yf += m_lowpass * (t.ya - t.yf + 1e-20f);
+	    t.xa = t.ya = 0.f;
+	 }
+	 m_count = 0;
+      }
+
+      return out;
+   }
+
+   /* engine thread; works out the delay from what has been heard so
+    * far. a poor fit is tried again upside down before giving up. */
+   void resolve() {
+      double d, e;
+      int solved = solve(d, e);
+      if (solved >= 0 && e > 0.35) {
+	 m_inverted = !m_inverted;
+	 solved = solve(d, e);
+      }
+
+      if (solved < 0) {
+	 state.store(QUIET, std::memory_order_relaxed);
+	 return;
+      }
+
+      error.store(float(e), std::memory_order_relaxed);
+      inverted.store(m_inverted, std::memory_order_relaxed);
+      if (solved == 0 && e <= 0.3) {
+	 delay.store(float(16 * d), std::memory_order_relaxed);
+	 state.store(LOCKED, std::memory_order_relaxed);
+      } else {
+	 state.store(UNSURE, std::memory_order_relaxed);
+      }
+   }
+
+private:
+   static constexpr double TWO_PI = 6.283185307179586;
+
+   struct tone {
+      // how far round each sample takes it, out of 65536
+      uint32_t step;
+      uint32_t phase;
+      // correlation with what returns, summing and then smoothed
+      float xa, ya, xf, yf;
+   };
+
+   // engine thread only
+   tone m_tones[TONES];
+   float m_lowpass;
+   int m_count;
+   bool m_inverted;
+
+   /* the delay in cycles of the first tone, and the worst error of any
+    * tone; 0 if every tone agreed, 1 if one didn't, -1 if too quiet */
+   int solve(double& d, double& worst) {
+      worst = 0;
+      const tone* t = m_tones;
+      if (std::hypot(t->xf, t->yf) < 0.001) return -1;
+
+      d = std::atan2(t->yf, t->xf) / TWO_PI;
+      if (m_inverted) d += 0.5;
+      if (d > 0.5) d -= 1.0;
+
+      double f0 = t->step;
+      int bit = 1;
+      for (int i = 1; i < TONES; i++) {
+	 t++;
+	 double p = std::atan2(t->yf, t->xf) / TWO_PI - d * t->step / f0;
+	 if (m_inverted) p += 0.5;
+	 p -= std::floor(p);
+	 p *= 2;
+	 int k = int(std::floor(p + 0.5));
+	 double e = std::fabs(p - k);
+	 if (e > worst) worst = e;
+	 if (e > 0.4) return 1;
+	 d += bit * (k & 1);
+	 bit *= 2;
+      }
+      return 0;
+   }
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+/* built with meson's -Drt_check=true, the realtime parts of the plugin
+ * tell the checker in tools/rt-check.cc when they are running, and it
+ * complains with a backtrace about anything they do which might block:
+ * allocating, waiting on a lock somebody else holds, sleeping, or going
+ * to the kernel. the benchmarks link it in; rack needs it preloaded,
+ *
+ *   LD_PRELOAD=build/librt-check.so Rack
+ *
+ * without the option, or without the checker loaded, all of this does
+ * nothing at all. */
+
+#ifdef STKJACK_RT_CHECK
+extern "C" {
+   void stkjack_rt_enter(void) __attribute__((weak));
+   void stkjack_rt_leave(void) __attribute__((weak));
+   void stkjack_rt_pause(void) __attribute__((weak));
+   void stkjack_rt_resume(void) __attribute__((weak));
+   unsigned long stkjack_rt_violations(void) __attribute__((weak));
+}
+#endif
+
+// the calling thread is realtime for as long as one of these lives
+struct rt_checked {
+#ifdef STKJACK_RT_CHECK
+   rt_checked() { if (stkjack_rt_enter) stkjack_rt_enter(); }
+   ~rt_checked() { if (stkjack_rt_leave) stkjack_rt_leave(); }
+#else
+   rt_checked() {}
+#endif
+};
+
+// ...except where blocking is what we meant to do
+struct rt_unchecked {
+#ifdef STKJACK_RT_CHECK
+   rt_unchecked() { if (stkjack_rt_pause) stkjack_rt_pause(); }
+   ~rt_unchecked() { if (stkjack_rt_resume) stkjack_rt_resume(); }
+#else
+   rt_unchecked() {}
+#endif
+};
+
+// how many times the checker has complained so far
+inline unsigned long rt_violations() {
+#ifdef STKJACK_RT_CHECK
+   if (stkjack_rt_violations) return stkjack_rt_violations();
+#endif
+   return 0;
+}
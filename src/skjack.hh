@@ -26,30 +26,43 @@
 using namespace rack;
 
 #include "jaq.hh"
-
-struct JackAudioModule;
-struct JackAudioModuleWidget;
+#include "jack-transport.hh"
+#include "metrics.hh"
 
 struct jack_audio_module_base;
 struct jack_audio_module_widget_base;
 
-struct jack_audio_out8_module_widget;
-struct jack_audio_out8_module;
+template <size_t TO_JACK, size_t FROM_JACK> struct jack_audio_module;
+template <size_t TO_JACK, size_t FROM_JACK> struct jack_audio_module_widget;
 
+struct JackAudioModuleWidget;
+struct jack_audio_out8_module_widget;
 struct jack_audio_in8_module_widget;
-struct jack_audio_in8_module;
 
-extern std::condition_variable g_jack_cv;
+struct jack_audio_poly_module;
+struct jack_audio_poly_module_widget;
+
+struct jack_latency_module;
+struct jack_latency_module_widget;
 
 // We'll be using this from here on out.
 extern jaq::client g_jack_client;
 
-extern std::mutex g_audio_modules_mutex;
-extern std::vector<jack_audio_module_base*> g_audio_modules;
-extern std::atomic<unsigned int> g_audio_blocked;
+// every module with jack ports, and how they are kept in step with jack
+extern jack_transport_hub g_transport;
+
+// publishes the two above for other processes to see, when asked to
+extern metrics_exporter g_metrics;
 
 extern const char* g_hashid_salt;
 
+// links and opens the client in the background the first time it's called
+void start_jack_client();
+
+// plugin settings, kept in rack's settings file
+extern bool g_lock_memory;
+extern bool g_export_metrics;
+
 // Forward-declare the Plugin, defined in skjack.cc
 extern Plugin *plugin;
 
@@ -57,3 +70,11 @@ extern Plugin *plugin;
 extern Model* jack_audio_model;
 extern Model* jack_audio_out8_model;
 extern Model* jack_audio_in8_model;
+extern Model* jack_audio_out16_model;
+extern Model* jack_audio_in16_model;
+extern Model* jack_audio_out32_model;
+extern Model* jack_audio_in32_model;
+extern Model* jack_audio_out64_model;
+extern Model* jack_audio_in64_model;
+extern Model* jack_audio_poly_model;
+extern Model* jack_latency_model;
@@ -0,0 +1,198 @@
+#include "trace.hh"
+
+#ifdef STKJACK_TRACE
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace trace {
+   struct event {
+      uint64_t ns;
+      const char* name;
+      char phase;
+   };
+
+   /* one thread writes a ring, our collecting thread reads it. a full
+    * ring drops new events rather than wait for the reader. */
+   struct ring {
+      static const size_t EVENTS = 1 << 14;
+
+      std::atomic<size_t> head;
+      std::atomic<size_t> tail;
+      std::atomic<unsigned long> dropped;
+      std::atomic<const char*> thread_name;
+      event events[EVENTS];
+   };
+
+   /* threads are handed rings from here and keep them for good, so the
+    * realtime thread never allocates one. a restarted jack server brings
+    * a new realtime thread, and with it a new ring; threads beyond the
+    * last ring go untraced. */
+   static const size_t RINGS = 32;
+   static ring g_rings[RINGS];
+   static std::atomic<size_t> g_rings_taken(0);
+
+   static thread_local ring* t_ring = nullptr;
+   static thread_local bool t_ringless = false;
+
+   static std::atomic<bool> g_recording(false);
+   static std::atomic<bool> g_saving(false);
+
+   // what the collecting thread has collected, and where it goes
+   static std::mutex g_mutex;
+   static std::vector<std::pair<size_t, event>> g_events;
+   static std::string g_path;
+
+   // let go of before everything above, should rack quit mid-trace
+   static struct collector_thread {
+      std::thread thread;
+      ~collector_thread() {
+	 g_recording = false;
+	 if (thread.joinable()) thread.join();
+      }
+   } g_collector;
+
+   static uint64_t now_ns() {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>
+	 (std::chrono::steady_clock::now().time_since_epoch()).count();
+   }
+
+   static ring* my_ring() {
+      if (t_ring || t_ringless) return t_ring;
+
+      size_t i = g_rings_taken.fetch_add(1);
+      if (i >= RINGS) {
+	 t_ringless = true;
+	 return nullptr;
+      }
+      t_ring = &g_rings[i];
+      return t_ring;
+   }
+
+   static void push(const char* name, char phase) {
+      if (!g_recording.load(std::memory_order_relaxed)) return;
+
+      ring* r = my_ring();
+      if (!r) return;
+
+      size_t head = r->head.load(std::memory_order_relaxed);
+      if (head - r->tail.load(std::memory_order_acquire) >= ring::EVENTS) {
+	 r->dropped.fetch_add(1, std::memory_order_relaxed);
+	 return;
+      }
+
+      event& e = r->events[head % ring::EVENTS];
+      e.ns = now_ns();
+      e.name = name;
+      e.phase = phase;
+      r->head.store(head + 1, std::memory_order_release);
+   }
+
+   void begin(const char* name) { push(name, 'B'); }
+   void end(const char* name) { push(name, 'E'); }
+
+   void name_thread(const char* name) {
+      ring* r = my_ring();
+      if (r) r->thread_name.store(name, std::memory_order_relaxed);
+   }
+
+   bool recording() { return g_recording; }
+   bool saving() { return g_saving; }
+
+   // collecting thread; takes everything waiting in every ring
+   static void collect() {
+      size_t rings = std::min(g_rings_taken.load(), RINGS);
+      for (size_t i = 0; i < rings; i++) {
+	 ring& r = g_rings[i];
+	 size_t tail = r.tail.load(std::memory_order_relaxed);
+	 size_t head = r.head.load(std::memory_order_acquire);
+	 for (; tail != head; tail++) {
+	    g_events.push_back(std::make_pair(i, r.events[tail % ring::EVENTS]));
+	 }
+	 r.tail.store(tail, std::memory_order_release);
+      }
+   }
+
+   static void save(const std::string& path) {
+      if (path.empty()) return;
+      FILE* f = fopen(path.c_str(), "w");
+      if (!f) return;
+
+      fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+      bool first = true;
+      size_t rings = std::min(g_rings_taken.load(), RINGS);
+      for (size_t i = 0; i < rings; i++) {
+	 const char* name = g_rings[i].thread_name.load();
+	 if (!name) continue;
+	 fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,"
+		 "\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", i + 1, name);
+	 first = false;
+      }
+
+      uint64_t origin = g_events.empty() ? 0 : g_events.front().second.ns;
+      for (auto& e : g_events) origin = std::min(origin, e.second.ns);
+
+      for (auto& e : g_events) {
+	 fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f}",
+		 first ? "" : ",\n", e.second.name, e.second.phase, e.first + 1,
+		 (e.second.ns - origin) / 1000.0);
+	 first = false;
+      }
+
+      fprintf(f, "\n]}\n");
+      fclose(f);
+
+      for (size_t i = 0; i < rings; i++) {
+	 unsigned long dropped = g_rings[i].dropped.exchange(0);
+	 if (dropped) fprintf(stderr, "trace: dropped %lu events on thread %zu\n", dropped, i + 1);
+      }
+   }
+
+   static void collector_main() {
+      while (g_recording) {
+	 std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	 std::unique_lock<std::mutex> lock(g_mutex);
+	 collect();
+      }
+
+      std::unique_lock<std::mutex> lock(g_mutex);
+      collect();
+      save(g_path);
+      g_events.clear();
+      g_events.shrink_to_fit();
+      g_saving = false;
+   }
+
+   void start() {
+      std::unique_lock<std::mutex> lock(g_mutex);
+      if (g_recording || g_saving) return;
+      if (g_collector.thread.joinable()) g_collector.thread.join();
+
+      // whatever was left over from before is of no interest
+      size_t rings = std::min(g_rings_taken.load(), RINGS);
+      for (size_t i = 0; i < rings; i++) {
+	 g_rings[i].tail.store(g_rings[i].head.load());
+      }
+
+      g_recording = true;
+      g_collector.thread = std::thread(&collector_main);
+   }
+
+   void stop_and_save(const std::string& path) {
+      std::unique_lock<std::mutex> lock(g_mutex);
+      if (!g_recording) return;
+
+      g_path = path;
+      g_saving = true;
+      g_recording = false;
+   }
+}
+
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+
+/* a timeline of what the jack thread and rack's engine are up to, for
+ * chasing xruns. built in only with -DSTKJACK_TRACE (meson -Dtrace=true);
+ * otherwise every TRACE_ macro is nothing.
+ *
+ * each thread writes begin and end events in to a ring of its own,
+ * without locks or allocation once it has one. while recording, a thread
+ * of ours collects them every so often; stopping writes the lot out as
+ * a chrome trace, for chrome://tracing or ui.perfetto.dev. names must be
+ * string literals, as only the pointer is kept. */
+
+#ifdef STKJACK_TRACE
+
+#include <string>
+
+namespace trace {
+   void begin(const char* name);
+   void end(const char* name);
+
+   // what the calling thread is called in the trace
+   void name_thread(const char* name);
+
+   bool recording();
+
+   // starts collecting; does nothing if already recording or still saving
+   void start();
+
+   // stops collecting, and writes what was collected to `path` from
+   // the collecting thread
+   void stop_and_save(const std::string& path);
+
+   // the last trace is still being written
+   bool saving();
+
+   struct scope {
+      const char* name;
+      scope(const char* name) : name(name) { begin(name); }
+      ~scope() { end(name); }
+   };
+}
+
+#define TRACE_CAT(a, b) a##b
+#define TRACE_SCOPE_AT(name, line) trace::scope TRACE_CAT(trace_scope_, line)(name)
+#define TRACE_SCOPE(name) TRACE_SCOPE_AT(name, __LINE__)
+#define TRACE_BEGIN(name) trace::begin(name)
+#define TRACE_END(name) trace::end(name)
+#define TRACE_THREAD(name) trace::name_thread(name)
+
+#else
+
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_BEGIN(name) do {} while (0)
+#define TRACE_END(name) do {} while (0)
+#define TRACE_THREAD(name) do {} while (0)
+
+#endif
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+
+#include "engine/Port.hpp"
+#include "simd/Vector.hpp"
+
+/* moving voltages between rack ports and lane frames, scaled from rack's
+ * ±10V to jack's ±1 and back. the modules move them this way, and
+ * bench/marshal-bench.cc times exactly these.
+ *
+ * rack keeps each port's voltages in its own struct, so mono ports are
+ * gathered in to a simd::float_4 four at a time and scaled together
+ * before being stored to the frame in one go. `count` must be a
+ * multiple of four. groups of four with no bit set in `active` are not
+ * touched on the rack side at all. */
+static inline void gather_voltages(const rack::engine::Input* in, float* samples, int count,
+				   uint64_t active)
+{
+   for (int i = 0; i < count; i += 4) {
+      rack::simd::float_4 v;
+      if (((active >> i) & 0xf) == 0) {
+	 v = 0.f;
+      } else {
+	 v = rack::simd::float_4(in[i].getVoltage(), in[i+1].getVoltage(),
+				 in[i+2].getVoltage(), in[i+3].getVoltage());
+	 v = v / 10.0f;
+      }
+      v.store(&samples[i]);
+   }
+}
+
+static inline void scatter_voltages(const float* samples, rack::engine::Output* out, int count,
+				    uint64_t active)
+{
+   for (int i = 0; i < count; i += 4) {
+      if (((active >> i) & 0xf) == 0) continue;
+
+      rack::simd::float_4 v = rack::simd::float_4::load(&samples[i]) * 10.0f;
+      out[i].setVoltage(v[0]);
+      out[i+1].setVoltage(v[1]);
+      out[i+2].setVoltage(v[2]);
+      out[i+3].setVoltage(v[3]);
+   }
+}
+
+/* the same for the voices of one polyphonic cable, which rack already
+ * keeps together. every one of `count` voices is written to the frame,
+ * silent where its group isn't active. */
+static inline void gather_poly_voltages(rack::engine::Input& in, float* samples, int count,
+					uint64_t active)
+{
+   for (int c = 0; c < count; c += 4) {
+      rack::simd::float_4 v = 0.f;
+      if (((active >> c) & 0xf) != 0) {
+	 v = in.getVoltageSimd<rack::simd::float_4>(c) / 10.0f;
+      }
+      v.store(&samples[c]);
+   }
+}
+
+// only the first `count` voices, rounded up to a group of four
+static inline void scatter_poly_voltages(const float* samples, rack::engine::Output& out,
+					 int count, uint64_t active)
+{
+   for (int c = 0; c < count; c += 4) {
+      if (((active >> c) & 0xf) == 0) continue;
+      out.setVoltageSimd(rack::simd::float_4::load(&samples[c]) * 10.0f, c);
+   }
+}
@@ -0,0 +1,694 @@
+/* see fake-jack.h. every jack function the plugin links to is here, and
+ * does what the plugin relies on it doing; nothing else is. */
+
+#include "fake-jack.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "jack/jack.h"
+#include "jack/metadata.h"
+
+// as big a period as anyone may ask for
+#define FAKEJACK_MAX_PERIOD 8192
+
+struct _jack_client;
+
+struct _jack_port {
+   jack_port_id_t id;
+   _jack_client* owner;
+   /* full name, client and all. renaming points it at a new one and
+    * leaves the old alone, so a name handed out stays readable for as
+    * long as the caller likes, as it does in real jack. */
+   std::atomic<const char*> name;
+   unsigned long flags;
+   bool alive;
+
+   // outputs are written here by their client; inputs are mixed in to
+   // here from their connections at the end of each cycle
+   std::vector<jack_default_audio_sample_t> buffer;
+
+   std::vector<_jack_port*> connections;
+};
+
+struct _jack_client {
+   std::string name;
+   std::atomic<bool> open;
+   std::atomic<bool> active;
+
+   JackProcessCallback process;
+   void* process_arg;
+   JackBufferSizeCallback buffer_size;
+   void* buffer_size_arg;
+   JackSampleRateCallback sample_rate;
+   void* sample_rate_arg;
+   JackPortConnectCallback port_connect;
+   void* port_connect_arg;
+   JackGraphOrderCallback graph_order;
+   void* graph_order_arg;
+   JackPortRegistrationCallback port_registration;
+   void* port_registration_arg;
+   JackPortRenameCallback port_rename;
+   void* port_rename_arg;
+   JackShutdownCallback shutdown;
+   void* shutdown_arg;
+   JackFreewheelCallback freewheel;
+   void* freewheel_arg;
+   JackXRunCallback xrun;
+   void* xrun_arg;
+};
+
+namespace {
+   /* clients, ports and port names are never freed, only marked dead
+    * or replaced, so a caller holding on to one too long reads stale
+    * state rather than crashing the test that is trying to find out
+    * about it. */
+   struct server {
+      // guards the graph: clients, ports, connections and properties
+      std::mutex graph;
+      std::vector<_jack_client*> clients;
+      std::vector<_jack_port*> ports;
+      std::deque<std::string> port_names;
+      std::map<std::pair<jack_uuid_t, std::string>, std::string> properties;
+
+      bool configured = false;
+      bool up = true;
+      bool manual = false;
+      std::atomic<jack_nframes_t> period{256};
+      jack_nframes_t rate = 48000;
+
+      // held for the whole of a cycle, and by anything changing what a
+      // cycle would do
+      std::mutex cycle;
+      std::atomic<unsigned long> cycles{0};
+      std::atomic<unsigned long> xruns{0};
+      std::atomic<jack_nframes_t> next_period{0};
+      std::atomic<unsigned int> held_back{0};
+      std::atomic<bool> freewheeling{false};
+
+      // percent of a period spent in process callbacks, smoothed
+      std::atomic<float> load{0.f};
+
+      std::mutex timer_mutex;
+      std::condition_variable timer_cv;
+      bool timer_quitting = false;
+      std::thread timer;
+
+      /* callbacks other than process are run here, one after another,
+       * as jack runs them on a thread of its own */
+      std::mutex notify_mutex;
+      std::condition_variable notify_cv;
+      std::deque<std::function<void()>> notifications;
+      std::thread notifier;
+
+      server() {
+	 notifier = std::thread([this]() { notify_main(); });
+	 notifier.detach();
+      }
+
+      void configure() {
+	 if (configured) return;
+	 configured = true;
+
+	 const char* period_env = getenv("FAKEJACK_PERIOD");
+	 const char* rate_env = getenv("FAKEJACK_RATE");
+	 const char* clock_env = getenv("FAKEJACK_CLOCK");
+	 if (period_env && atoi(period_env) > 0) {
+	    period = std::min(atoi(period_env), FAKEJACK_MAX_PERIOD);
+	 }
+	 if (rate_env && atoi(rate_env) > 0) rate = atoi(rate_env);
+	 manual = clock_env && strcmp(clock_env, "manual") == 0;
+
+	 auto system = new _jack_client();
+	 system->name = "system";
+	 system->open = true;
+	 clients.push_back(system);
+	 add_port(system, "capture_1", JackPortIsOutput | JackPortIsPhysical);
+	 add_port(system, "capture_2", JackPortIsOutput | JackPortIsPhysical);
+	 add_port(system, "playback_1", JackPortIsInput | JackPortIsPhysical);
+	 add_port(system, "playback_2", JackPortIsInput | JackPortIsPhysical);
+      }
+
+      // graph must be held
+      _jack_port* add_port(_jack_client* owner, const char* short_name, unsigned long flags) {
+	 auto p = new _jack_port();
+	 p->id = ports.size();
+	 p->owner = owner;
+	 p->name = keep_name(owner->name + ":" + short_name);
+	 p->flags = flags;
+	 p->alive = true;
+	 p->buffer.assign(FAKEJACK_MAX_PERIOD, 0.f);
+	 ports.push_back(p);
+	 return p;
+      }
+
+      // graph must be held
+      _jack_port* find(const char* name) {
+	 for (auto p : ports) {
+	    if (p->alive && strcmp(p->name, name) == 0) return p;
+	 }
+	 return nullptr;
+      }
+
+      // graph must be held; good for as long as the server is
+      const char* keep_name(const std::string& name) {
+	 port_names.push_back(name);
+	 return port_names.back().c_str();
+      }
+
+      void notify(std::function<void()> f) {
+	 std::unique_lock<std::mutex> lock(notify_mutex);
+	 notifications.push_back(std::move(f));
+	 notify_cv.notify_one();
+      }
+
+      void notify_main() {
+	 std::unique_lock<std::mutex> lock(notify_mutex);
+	 for (;;) {
+	    notify_cv.wait(lock, [this]() { return !notifications.empty(); });
+	    auto f = std::move(notifications.front());
+	    notifications.pop_front();
+	    lock.unlock();
+	    f();
+	    lock.lock();
+	 }
+      }
+
+      // runs `f` for every open client, on the notification thread
+      template <typename F>
+      void tell_clients(F f) {
+	 std::vector<_jack_client*> open;
+	 {
+	    std::unique_lock<std::mutex> lock(graph);
+	    for (auto c : clients) if (c->open) open.push_back(c);
+	 }
+	 for (auto c : open) {
+	    notify([c, f]() { if (c->open) f(c); });
+	 }
+      }
+
+      void tell_registration(jack_port_id_t id, int registered) {
+	 tell_clients([id, registered](_jack_client* c) {
+	    if (c->port_registration) c->port_registration(id, registered, c->port_registration_arg);
+	 });
+      }
+
+      void count_xrun() {
+	 xruns++;
+	 tell_clients([](_jack_client* c) {
+	    if (c->xrun) c->xrun(c->xrun_arg);
+	 });
+      }
+
+      void tell_connection(jack_port_id_t a, jack_port_id_t b, int connected) {
+	 tell_clients([a, b, connected](_jack_client* c) {
+	    if (c->port_connect) c->port_connect(a, b, connected, c->port_connect_arg);
+	    if (c->graph_order) c->graph_order(c->graph_order_arg);
+	 });
+      }
+
+      /* one process cycle for every active client; then whatever each
+       * output wrote is handed to the inputs it is connected to, ready
+       * for the cycle after. cycle must be held. */
+      void run_cycle() {
+	 std::vector<_jack_client*> active;
+	 {
+	    std::unique_lock<std::mutex> lock(graph);
+	    for (auto c : clients) if (c->open && c->active) active.push_back(c);
+	 }
+
+	 // a new period size is taken up between cycles, as jack does
+	 jack_nframes_t resized = next_period.exchange(0);
+	 if (resized) {
+	    period = resized;
+	    for (auto c : active) {
+	       if (c->buffer_size) c->buffer_size(resized, c->buffer_size_arg);
+	    }
+	 }
+
+	 jack_nframes_t nframes = period;
+	 auto started = std::chrono::steady_clock::now();
+	 for (auto c : active) {
+	    if (c->process) c->process(nframes, c->process_arg);
+	 }
+
+	 float took = std::chrono::duration<float>(std::chrono::steady_clock::now() - started).count();
+	 float percent = took * rate / nframes * 100.f;
+	 load = load + (percent - load) / 16.f;
+
+	 std::unique_lock<std::mutex> lock(graph);
+	 for (auto p : ports) {
+	    if (!p->alive || !(p->flags & JackPortIsInput)) continue;
+	    std::fill(p->buffer.begin(), p->buffer.begin() + nframes, 0.f);
+	    for (auto from : p->connections) {
+	       for (jack_nframes_t i = 0; i < nframes; i++) p->buffer[i] += from->buffer[i];
+	    }
+	 }
+
+	 cycles++;
+      }
+
+      bool anyone_active() {
+	 std::unique_lock<std::mutex> lock(graph);
+	 for (auto c : clients) if (c->open && c->active) return true;
+	 return false;
+      }
+
+      /* runs cycles on a fixed schedule of whole periods from when it
+       * started. a cycle that can't make its slot counts as an xrun and
+       * the schedule starts over from there. */
+      void timer_main() {
+	 typedef std::chrono::steady_clock clock;
+	 auto period_length = [this]() {
+	    return std::chrono::nanoseconds((long long)period * 1000000000LL / rate);
+	 };
+
+	 auto next = clock::now() + period_length();
+	 std::unique_lock<std::mutex> lock(timer_mutex);
+	 while (!timer_quitting) {
+	    unsigned int held = held_back.exchange(0);
+	    if (held) {
+	       count_xrun();
+	       next += period_length() * held;
+	    }
+
+	    if (!freewheeling) {
+	       timer_cv.wait_until(lock, next, [this]() { return timer_quitting; });
+	       if (timer_quitting) break;
+	    }
+
+	    lock.unlock();
+	    {
+	       std::unique_lock<std::mutex> cycle_lock(cycle);
+	       run_cycle();
+	    }
+	    lock.lock();
+
+	    auto now = clock::now();
+	    next += period_length();
+	    if (freewheeling) {
+	       next = now + period_length();
+	    } else if (now > next) {
+	       count_xrun();
+	       next = now + period_length();
+	    }
+	 }
+      }
+
+      void start_timer() {
+	 if (manual || timer.joinable()) return;
+	 timer_quitting = false;
+	 timer = std::thread([this]() { timer_main(); });
+      }
+
+      void stop_timer() {
+	 {
+	    std::unique_lock<std::mutex> lock(timer_mutex);
+	    timer_quitting = true;
+	 }
+	 timer_cv.notify_all();
+	 if (timer.joinable() && timer.get_id() != std::this_thread::get_id()) timer.join();
+      }
+   };
+
+   server& the_server() {
+      // never torn down; clients may still be calling in at exit
+      static server* s = new server();
+      return *s;
+   }
+}
+
+extern "C" {
+
+jack_client_t* jack_client_open(const char* client_name, jack_options_t, jack_status_t* status, ...) {
+   auto& s = the_server();
+   std::unique_lock<std::mutex> lock(s.graph);
+   s.configure();
+
+   if (!s.up) {
+      if (status) *status = (jack_status_t)(JackFailure | JackServerFailed);
+      return nullptr;
+   }
+
+   auto c = new _jack_client();
+   c->name = client_name;
+   for (int n = 2; ; n++) {
+      bool taken = false;
+      for (auto other : s.clients) {
+	 if (other->open && other->name == c->name) taken = true;
+      }
+      if (!taken) break;
+      c->name = std::string(client_name) + "-" + std::to_string(n);
+   }
+   c->open = true;
+   s.clients.push_back(c);
+
+   if (status) *status = (jack_status_t)0;
+   return c;
+}
+
+int jack_client_close(jack_client_t* client) {
+   auto& s = the_server();
+   std::vector<jack_port_id_t> gone;
+   {
+      // no cycle may be running our callback while we go
+      std::unique_lock<std::mutex> cycle_lock(s.cycle);
+      std::unique_lock<std::mutex> lock(s.graph);
+      client->active = false;
+      client->open = false;
+      for (auto p : s.ports) {
+	 if (p->owner != client || !p->alive) continue;
+	 p->alive = false;
+	 gone.push_back(p->id);
+      }
+      for (auto p : s.ports) {
+	 p->connections.erase
+	    (std::remove_if(p->connections.begin(), p->connections.end(),
+			    [client](_jack_port* q) { return q->owner == client; }),
+	     p->connections.end());
+      }
+   }
+
+   if (!s.anyone_active()) s.stop_timer();
+   for (auto id : gone) s.tell_registration(id, 0);
+   return 0;
+}
+
+int jack_activate(jack_client_t* client) {
+   auto& s = the_server();
+   {
+      std::unique_lock<std::mutex> lock(s.graph);
+      if (!s.up || !client->open) return -1;
+      client->active = true;
+   }
+   s.start_timer();
+   return 0;
+}
+
+char* jack_get_client_name(jack_client_t* client) {
+   return const_cast<char*>(client->name.c_str());
+}
+
+jack_nframes_t jack_get_buffer_size(jack_client_t*) {
+   return the_server().period;
+}
+
+jack_nframes_t jack_get_sample_rate(jack_client_t*) {
+   return the_server().rate;
+}
+
+float jack_cpu_load(jack_client_t*) {
+   return the_server().load;
+}
+
+// the fake's periods take exactly as long as they should
+int jack_get_cycle_times(const jack_client_t*, jack_nframes_t* current_frames,
+			 jack_time_t* current_usecs, jack_time_t* next_usecs, float* period_usecs) {
+   server& s = the_server();
+   jack_nframes_t period = s.period;
+   *period_usecs = period * 1e6f / s.rate;
+   *current_frames = jack_nframes_t(s.cycles * period);
+   *current_usecs = std::chrono::duration_cast<std::chrono::microseconds>
+      (std::chrono::steady_clock::now().time_since_epoch()).count();
+   *next_usecs = *current_usecs + jack_time_t(*period_usecs);
+   return 0;
+}
+
+#define FAKEJACK_SETTER(fn, type, field)				\
+   int fn(jack_client_t* client, type cb, void* arg) {			\
+      std::unique_lock<std::mutex> lock(the_server().graph);		\
+      client->field = cb;						\
+      client->field##_arg = arg;					\
+      return 0;								\
+   }
+
+FAKEJACK_SETTER(jack_set_process_callback, JackProcessCallback, process)
+FAKEJACK_SETTER(jack_set_buffer_size_callback, JackBufferSizeCallback, buffer_size)
+FAKEJACK_SETTER(jack_set_sample_rate_callback, JackSampleRateCallback, sample_rate)
+FAKEJACK_SETTER(jack_set_port_connect_callback, JackPortConnectCallback, port_connect)
+FAKEJACK_SETTER(jack_set_graph_order_callback, JackGraphOrderCallback, graph_order)
+FAKEJACK_SETTER(jack_set_port_registration_callback, JackPortRegistrationCallback, port_registration)
+FAKEJACK_SETTER(jack_set_port_rename_callback, JackPortRenameCallback, port_rename)
+FAKEJACK_SETTER(jack_set_freewheel_callback, JackFreewheelCallback, freewheel)
+FAKEJACK_SETTER(jack_set_xrun_callback, JackXRunCallback, xrun)
+
+#undef FAKEJACK_SETTER
+
+void jack_on_shutdown(jack_client_t* client, JackShutdownCallback cb, void* arg) {
+   std::unique_lock<std::mutex> lock(the_server().graph);
+   client->shutdown = cb;
+   client->shutdown_arg = arg;
+}
+
+jack_port_t* jack_port_register(jack_client_t* client, const char* port_name,
+				const char*, unsigned long flags, unsigned long)
+{
+   auto& s = the_server();
+   _jack_port* p;
+   {
+      std::unique_lock<std::mutex> lock(s.graph);
+      if (!client->open) return nullptr;
+      if (s.find((client->name + ":" + port_name).c_str())) return nullptr;
+      p = s.add_port(client, port_name, flags);
+   }
+   s.tell_registration(p->id, 1);
+   return p;
+}
+
+int jack_port_unregister(jack_client_t* client, jack_port_t* port) {
+   auto& s = the_server();
+   std::vector<jack_port_id_t> peers;
+   {
+      std::unique_lock<std::mutex> lock(s.graph);
+      if (!port->alive || port->owner != client) return -1;
+      port->alive = false;
+
+      for (auto peer : s.ports) {
+	 auto& c = peer->connections;
+	 auto end = std::remove(c.begin(), c.end(), port);
+	 if (end != c.end()) peers.push_back(peer->id);
+	 c.erase(end, c.end());
+      }
+      for (auto peer : port->connections) peers.push_back(peer->id);
+      port->connections.clear();
+   }
+
+   for (auto peer : peers) s.tell_connection(port->id, peer, 0);
+   s.tell_registration(port->id, 0);
+   return 0;
+}
+
+int jack_port_rename(jack_client_t* client, jack_port_t* port, const char* port_name) {
+   auto& s = the_server();
+   std::string old_name;
+   std::string new_name;
+   {
+      std::unique_lock<std::mutex> lock(s.graph);
+      if (!port->alive || port->owner != client) return -1;
+      new_name = client->name + ":" + port_name;
+      if (s.find(new_name.c_str())) return -1;
+      old_name = port->name.load();
+      port->name = s.keep_name(new_name);
+   }
+
+   jack_port_id_t id = port->id;
+   s.tell_clients([id, old_name, new_name](_jack_client* c) {
+      if (c->port_rename) c->port_rename(id, old_name.c_str(), new_name.c_str(), c->port_rename_arg);
+   });
+   return 0;
+}
+
+void* jack_port_get_buffer(jack_port_t* port, jack_nframes_t) {
+   return port->buffer.data();
+}
+
+jack_port_t* jack_port_by_name(jack_client_t*, const char* port_name) {
+   auto& s = the_server();
+   std::unique_lock<std::mutex> lock(s.graph);
+   return s.find(port_name);
+}
+
+jack_port_t* jack_port_by_id(jack_client_t*, jack_port_id_t port_id) {
+   auto& s = the_server();
+   std::unique_lock<std::mutex> lock(s.graph);
+   if (port_id >= s.ports.size()) return nullptr;
+   return s.ports[port_id];
+}
+
+const char* jack_port_name(const jack_port_t* port) {
+   return port->name;
+}
+
+int jack_port_flags(const jack_port_t* port) {
+   return (int)port->flags;
+}
+
+int jack_port_is_mine(const jack_client_t* client, const jack_port_t* port) {
+   return port->owner == client;
+}
+
+// there is no hardware, so nothing between a port and the world outside
+void jack_port_get_latency_range(jack_port_t*, jack_latency_callback_mode_t,
+				 jack_latency_range_t* range) {
+   range->min = range->max = 0;
+}
+
+jack_uuid_t jack_port_uuid(const jack_port_t* port) {
+   return (jack_uuid_t)port->id + 1;
+}
+
+/* one allocation, as jack_free is only ever handed the array: the
+ * pointers first, then the names they point in to */
+const char** jack_port_get_connections(const jack_port_t* port) {
+   auto& s = the_server();
+   std::unique_lock<std::mutex> lock(s.graph);
+
+   std::vector<_jack_port*> peers;
+   if (port->flags & JackPortIsInput) {
+      peers = port->connections;
+   } else {
+      for (auto p : s.ports) {
+	 if (!p->alive) continue;
+	 auto& c = p->connections;
+	 if (std::find(c.begin(), c.end(), port) != c.end()) peers.push_back(p);
+      }
+   }
+   if (peers.empty()) return nullptr;
+
+   size_t size = sizeof(char*) * (peers.size() + 1);
+   for (auto p : peers) size += strlen(p->name) + 1;
+
+   auto names = reinterpret_cast<const char**>(malloc(size));
+   char* text = reinterpret_cast<char*>(names + peers.size() + 1);
+   for (size_t i = 0; i < peers.size(); i++) {
+      size_t length = strlen(peers[i]->name) + 1;
+      memcpy(text, peers[i]->name, length);
+      names[i] = text;
+      text += length;
+   }
+   names[peers.size()] = nullptr;
+   return names;
+}
+
+void jack_free(void* ptr) {
+   free(ptr);
+}
+
+int jack_connect(jack_client_t*, const char* source_port, const char* destination_port) {
+   auto& s = the_server();
+   jack_port_id_t a, b;
+   {
+      std::unique_lock<std::mutex> lock(s.graph);
+      auto from = s.find(source_port);
+      auto to = s.find(destination_port);
+      if (!from || !to) return -1;
+      if (!(from->flags & JackPortIsOutput) || !(to->flags & JackPortIsInput)) return -1;
+
+      auto& c = to->connections;
+      if (std::find(c.begin(), c.end(), from) != c.end()) return EEXIST;
+      c.push_back(from);
+      a = from->id;
+      b = to->id;
+   }
+
+   s.tell_connection(a, b, 1);
+   return 0;
+}
+
+int jack_set_property(jack_client_t*, jack_uuid_t subject, const char* key,
+		      const char* value, const char*)
+{
+   auto& s = the_server();
+   std::unique_lock<std::mutex> lock(s.graph);
+   s.properties[std::make_pair(subject, std::string(key))] = value;
+   return 0;
+}
+
+int jack_remove_property(jack_client_t*, jack_uuid_t subject, const char* key) {
+   auto& s = the_server();
+   std::unique_lock<std::mutex> lock(s.graph);
+   return s.properties.erase(std::make_pair(subject, std::string(key))) ? 0 : -1;
+}
+
+unsigned long fakejack_step(unsigned int cycles) {
+   auto& s = the_server();
+   unsigned long ran = 0;
+   for (unsigned int i = 0; i < cycles; i++) {
+      std::unique_lock<std::mutex> lock(s.cycle);
+      if (!s.up || !s.anyone_active()) break;
+      if (s.held_back.exchange(0)) s.count_xrun();
+      s.run_cycle();
+      ran++;
+   }
+   return ran;
+}
+
+unsigned long fakejack_cycles(void) {
+   return the_server().cycles;
+}
+
+void fakejack_set_buffer_size(jack_nframes_t nframes) {
+   if (nframes == 0) return;
+   the_server().next_period = std::min(nframes, (jack_nframes_t)FAKEJACK_MAX_PERIOD);
+}
+
+void fakejack_xrun(unsigned int periods) {
+   the_server().held_back += periods;
+}
+
+unsigned long fakejack_xruns(void) {
+   return the_server().xruns;
+}
+
+void fakejack_set_freewheel(int on) {
+   auto& s = the_server();
+   if (s.freewheeling.exchange(on != 0) == (on != 0)) return;
+
+   s.timer_cv.notify_all();
+   s.tell_clients([on](_jack_client* c) {
+      if (c->freewheel) c->freewheel(on, c->freewheel_arg);
+   });
+}
+
+void fakejack_shutdown(void) {
+   auto& s = the_server();
+   s.stop_timer();
+
+   std::vector<_jack_client*> told;
+   {
+      std::unique_lock<std::mutex> cycle_lock(s.cycle);
+      std::unique_lock<std::mutex> lock(s.graph);
+      s.up = false;
+      for (auto c : s.clients) {
+	 if (!c->open || c->name == "system") continue;
+	 c->active = false;
+	 told.push_back(c);
+      }
+   }
+
+   // clients are left to close themselves, as they would be by jack
+   for (auto c : told) {
+      s.notify([c]() { if (c->shutdown) c->shutdown(c->shutdown_arg); });
+   }
+}
+
+void fakejack_restart(void) {
+   auto& s = the_server();
+   std::unique_lock<std::mutex> lock(s.graph);
+   s.up = true;
+}
+
+}
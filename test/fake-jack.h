@@ -0,0 +1,55 @@
+#pragma once
+
+#include "jack/types.h"
+
+/* a jack server and client library in one, for running the plugin on
+ * machines with no server and no sound card. build it, then point the
+ * plugin at it with STKJACK_LIBJACK=/path/to/libjack-fake.so.
+ *
+ * it has a "system" client with two capture and two playback ports, and
+ * runs process cycles for every active client. an input port hears what
+ * its connected outputs wrote in the cycle before, so a loopback through
+ * the fake takes exactly one period.
+ *
+ * it is set up from the environment when the first client opens:
+ *
+ *   FAKEJACK_PERIOD  frames per period, 256 by default
+ *   FAKEJACK_RATE    sample rate, 48000 by default
+ *   FAKEJACK_CLOCK   "timer" runs cycles on a thread of its own at the
+ *                    rate a real server would; "manual" runs nothing
+ *                    until fakejack_step is called
+ *
+ * and steered while it runs through the functions below, from whichever
+ * program loaded it alongside the plugin. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// runs up to `cycles` periods on the calling thread, right away;
+// returns how many ran. nothing runs while no client is active.
+unsigned long fakejack_step(unsigned int cycles);
+
+// process cycles run so far
+unsigned long fakejack_cycles(void);
+
+// changes the period size before the next cycle, telling every client
+void fakejack_set_buffer_size(jack_nframes_t nframes);
+
+// holds back the next cycle by `periods` periods, as a real xrun would
+void fakejack_xrun(unsigned int periods);
+
+// cycles which ran late, whether asked for or not
+unsigned long fakejack_xruns(void);
+
+// runs cycles back to back rather than in real time while `on`
+void fakejack_set_freewheel(int on);
+
+/* the server goes away: cycles stop, every client is told it was shut
+ * down and no client can be opened until fakejack_restart. */
+void fakejack_shutdown(void);
+void fakejack_restart(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,447 @@
+/* runs the jack client and the transport against the fake jack for a
+ * while, with everything the plugin's modules do to them happening at
+ * once and as often as possible: several threads adding, removing and
+ * renaming modules, one changing the period size, one taking the server
+ * away and bringing it back, an engine thread making audio for every
+ * module and the fake's own thread running short periods. the modules
+ * are the plugin's own jack side of a module; only rack is left out.
+ * then takes every module away again and exits the way rack does, with
+ * the client still running.
+ *
+ *   soak [seconds] [threads]
+ *
+ * ten seconds and four threads by default, at a period of 64 frames
+ * unless FAKEJACK_PERIOD says otherwise. prints how many periods ran
+ * late, went without audio or kept the engine waiting, and how long
+ * periods and each kind of change took. fails if periods stop running
+ * altogether while the server is up. meant to be run built with
+ * -Db_sanitize=thread or -Db_sanitize=address, which do the rest of the
+ * checking. */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dlfcn.h>
+
+#include "fake-jack.h"
+#include "jack-module-ports.hh"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wall"
+#pragma GCC diagnostic ignored "-Wextra"
+#include "logger.hpp"
+#pragma GCC diagnostic pop
+
+// jaq logs through rack; without rack, only what might matter is shown
+namespace rack {
+namespace logger {
+   void log(Level level, const char* filename, int line, const char* func, const char* format, ...) {
+      (void)filename;
+      (void)line;
+      (void)func;
+      if (level < WARN_LEVEL) return;
+
+      va_list args;
+      va_start(args, format);
+      fprintf(stderr, "soak: ");
+      vfprintf(stderr, format, args);
+      fprintf(stderr, "\n");
+      va_end(args);
+   }
+}
+}
+
+static const int RACK_RATE = 48000;
+
+// every module's peers, so connections are made and torn down as well
+static const char* const PLAYBACK = "system:playback_1";
+static const char* const CAPTURE = "system:capture_1";
+
+// as the plugin's, and in the same order; see skjack.cc
+jack_transport_hub g_transport;
+jaq::client g_jack_client;
+
+/* how long each period took, and how far past its time it started.
+ * made up front so the jack thread only ever writes in to them, and
+ * never freed, as the jack thread is still running as we exit. */
+static float* g_period_us;
+static float* g_late_us;
+static size_t g_most_periods;
+static std::atomic<size_t> g_recorded(0);
+
+static int on_jack_process(jack_nframes_t nframes, void*) {
+   if (!g_jack_client.alive()) return 1;
+
+   static uint64_t last_started = 0;
+   static jack_nframes_t last_nframes = 0;
+   uint64_t started = monotonic_ns();
+
+   g_transport.buffersize = g_jack_client.buffersize.load();
+   g_transport.samplerate = g_jack_client.samplerate.load();
+   g_transport.freewheeling = g_jack_client.freewheeling();
+   g_transport.running = true;
+   g_transport.run_period(nframes);
+
+   size_t i = g_recorded.load(std::memory_order_relaxed);
+   jack_nframes_t rate = g_jack_client.samplerate;
+   if (i < g_most_periods && last_started && last_nframes == nframes && rate) {
+      float expected_us = nframes * 1e6f / rate;
+      g_period_us[i] = (monotonic_ns() - started) / 1000.f;
+      g_late_us[i] = std::max(0.f, (started - last_started) / 1000.f - expected_us);
+      g_recorded.store(i + 1, std::memory_order_release);
+   }
+   last_started = started;
+   last_nframes = nframes;
+   return 0;
+}
+
+static void on_jack_shutdown(void*) {
+   g_transport.running = false;
+   g_transport.wake();
+}
+
+/* a module without rack: the plugin's own jack side of one, with every
+ * rack cable patched, a tone going out and whatever comes in thrown
+ * away. */
+struct soak_module: public jack_module_ports {
+   unsigned int activity;
+   float phase;
+
+   soak_module(size_t to_jack, size_t from_jack, const std::string& identity)
+      : jack_module_ports(g_jack_client, g_transport, to_jack, from_jack),
+	activity(0), phase(0)
+   {
+      for (size_t i = 0; i < jack_ports(); i++) {
+	 bool output = i < to_jack_ports;
+	 port_names[i] = identity + "-" + std::to_string(i);
+	 saved_connections[i].push_back(output ? PLAYBACK : CAPTURE);
+      }
+   }
+
+   bool rack_side_connected(size_t) override {
+      return true;
+   }
+
+   // what the module's process would do for one rack sample
+   void process() {
+      if (!jack_ready()) return;
+      if (++activity % 256 == 0) refresh_activity();
+      engine_step(RACK_RATE, g_jack_client.samplerate);
+   }
+
+   virtual void engine_step(int rack_rate, int jack_rate) = 0;
+};
+
+template <size_t TO_JACK, size_t FROM_JACK>
+struct soak_module_of: public soak_module {
+   jack_lanes<TO_JACK, FROM_JACK> lanes;
+   float heard;
+
+   soak_module_of(const std::string& identity)
+      : soak_module(TO_JACK, FROM_JACK, identity), heard(0)
+   {
+      globally_register();
+   }
+
+   ~soak_module_of() {
+      globally_unregister();
+   }
+
+   void engine_step(int rack_rate, int jack_rate) override {
+      lanes.step(*this, rack_rate, jack_rate,
+		 [this](const float* samples) {
+		    heard += samples[0];
+		 },
+		 [this](float* samples) {
+		    for (int c = 0; c < (int)TO_JACK; c++) samples[c] = phase;
+		    phase = (phase > 1.f) ? -1.f : phase + 0.01f;
+		 });
+   }
+
+   void on_jack_period(jack_nframes_t nframes) override {
+      jack_default_audio_sample_t* buffers[TO_JACK + FROM_JACK];
+      collect_buffers(buffers, nframes);
+      lanes.exchange(*this, buffers, nframes);
+   }
+
+   bool period_ready(jack_nframes_t nframes) override {
+      return lanes.ready(nframes);
+   }
+};
+
+// the shapes the plugin ships, more or less
+static soak_module* make_module(unsigned int shape, const std::string& identity) {
+   switch (shape % 4) {
+   case 0: return new soak_module_of<4, 4>(identity);
+   case 1: return new soak_module_of<8, 0>(identity);
+   case 2: return new soak_module_of<0, 8>(identity);
+   default: return new soak_module_of<16, 16>(identity);
+   }
+}
+
+/* stands in for rack's engine: holds this while stepping every module,
+ * as rack holds its own lock, so modules only come and go between
+ * blocks */
+static std::mutex g_engine_mutex;
+static std::vector<soak_module*> g_engine_modules;
+static std::atomic<bool> g_quitting(false);
+
+static void engine_main() {
+   static const int BLOCK = 32;
+   while (!g_quitting) {
+      bool any = false;
+      {
+	 std::unique_lock<std::mutex> lock(g_engine_mutex);
+	 any = !g_engine_modules.empty() && g_jack_client.active();
+	 for (int i = 0; i < BLOCK; i++) {
+	    for (auto module : g_engine_modules) module->process();
+	 }
+      }
+      // rather than spin while there's nothing to wait on jack for
+      if (!any) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+   }
+}
+
+// how long each kind of change took, in milliseconds
+struct op_times {
+   std::vector<double> add, remove, rename, save;
+
+   void merge(const op_times& other) {
+      add.insert(add.end(), other.add.begin(), other.add.end());
+      remove.insert(remove.end(), other.remove.begin(), other.remove.end());
+      rename.insert(rename.end(), other.rename.begin(), other.rename.end());
+      save.insert(save.end(), other.save.begin(), other.save.end());
+   }
+};
+
+static std::mutex g_times_mutex;
+static op_times g_times;
+
+static double milliseconds_since(uint64_t started) {
+   return (monotonic_ns() - started) / 1e6;
+}
+
+// the engine lets go of a module before it is torn down, as rack's does
+static void remove_module(soak_module* module) {
+   uint64_t started = monotonic_ns();
+   {
+      std::unique_lock<std::mutex> lock(g_engine_mutex);
+      g_engine_modules.erase(std::find(g_engine_modules.begin(), g_engine_modules.end(), module));
+   }
+   delete module;
+   std::unique_lock<std::mutex> lock(g_times_mutex);
+   g_times.remove.push_back(milliseconds_since(started));
+}
+
+/* one person patching: adds, removes and renames modules of its own,
+ * and saves the patch now and then, as fast as it can */
+static void patcher_main(unsigned int id, uint64_t until) {
+   static const size_t MOST_MODULES = 8;
+   std::mt19937 rng(id + 1);
+   std::vector<soak_module*> mine;
+   op_times times;
+   unsigned int made = 0;
+
+   while (monotonic_ns() < until) {
+      unsigned int roll = rng() % 100;
+      uint64_t started = monotonic_ns();
+
+      if (mine.size() < 2 || (roll < 25 && mine.size() < MOST_MODULES)) {
+	 std::string identity = "soak" + std::to_string(id) + "x" + std::to_string(made++);
+	 soak_module* module = make_module(rng(), identity);
+	 {
+	    // rack's onAdd comes from within the engine's lock
+	    std::unique_lock<std::mutex> lock(g_engine_mutex);
+	    g_engine_modules.push_back(module);
+	    module->on_added();
+	 }
+	 mine.push_back(module);
+	 times.add.push_back(milliseconds_since(started));
+      } else if (roll < 50) {
+	 size_t which = rng() % mine.size();
+	 soak_module* module = mine[which];
+	 mine.erase(mine.begin() + which);
+	 remove_module(module);
+      } else if (roll < 90) {
+	 soak_module* module = mine[rng() % mine.size()];
+	 size_t port = rng() % module->jack_ports();
+	 std::string name = "renamed" + std::to_string(id) + "x" + std::to_string(rng() % 1000);
+	 // as the widget does; the name may come back numbered
+	 module->rename_port(port, name);
+	 times.rename.push_back(milliseconds_since(started));
+      } else {
+	 // what toJson asks of each port, with the names the widget last saw
+	 for (auto module : mine) {
+	    module->refresh_port_names();
+	    for (size_t i = 0; i < module->jack_ports(); i++) {
+	       module->connections_of(i);
+	    }
+	 }
+	 times.save.push_back(milliseconds_since(started));
+      }
+
+      std::this_thread::sleep_for(std::chrono::microseconds(rng() % 2000));
+   }
+
+   // closing the patch
+   for (auto module : mine) remove_module(module);
+
+   std::unique_lock<std::mutex> lock(g_times_mutex);
+   g_times.merge(times);
+}
+
+// changes the period size now and then, and sometimes holds a period back
+static std::atomic<unsigned long> g_resizes(0);
+static std::atomic<unsigned long> g_injected_xruns(0);
+
+static void server_main(uint64_t until) {
+   static const jack_nframes_t sizes[] = {32, 64, 128, 256};
+   std::mt19937 rng(1234);
+
+   while (monotonic_ns() < until) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100 + rng() % 400));
+      if (rng() % 4 == 0) {
+	 fakejack_xrun(1);
+	 g_injected_xruns++;
+      } else {
+	 fakejack_set_buffer_size(sizes[rng() % 4]);
+	 g_resizes++;
+      }
+   }
+}
+
+/* takes the server away every so often and brings it back a moment
+ * later, so modules come and go while there's no jack as well, and the
+ * client reconnects with patchers busy. the watchdog in main doesn't
+ * count the time it is gone. */
+static std::atomic<unsigned long> g_outages(0);
+static std::atomic<bool> g_server_down(false);
+
+static void outage_main(uint64_t until) {
+   std::mt19937 rng(4321);
+
+   while (monotonic_ns() < until) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1000 + rng() % 2000));
+      if (monotonic_ns() >= until) break;
+
+      g_server_down = true;
+      fakejack_shutdown();
+      g_outages++;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100 + rng() % 400));
+      fakejack_restart();
+      g_server_down = false;
+   }
+}
+
+// `sorted` must be sorted
+template <typename T>
+static double percentile(const std::vector<T>& sorted, double q) {
+   if (sorted.empty()) return 0;
+   size_t i = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+   return sorted[i];
+}
+
+template <typename T>
+static void print_times(const char* what, std::vector<T> times, const char* unit) {
+   std::sort(times.begin(), times.end());
+   printf("%-10s %7zu   p50 %9.3f p99 %9.3f p99.9 %9.3f max %9.3f %s\n",
+	  what, times.size(), percentile(times, 0.5), percentile(times, 0.99),
+	  percentile(times, 0.999), times.empty() ? 0.0 : (double)times.back(), unit);
+}
+
+int main(int argc, char** argv) {
+   double seconds = (argc > 1) ? atof(argv[1]) : 10.0;
+   if (seconds <= 0) seconds = 10.0;
+   int threads = (argc > 2) ? atoi(argv[2]) : 4;
+   if (threads <= 0) threads = 4;
+
+   /* the client loads jack itself; point it at the fake we're linked
+    * to, so the two are one and the same */
+   Dl_info info;
+   if (dladdr(reinterpret_cast<void*>(&fakejack_step), &info) && info.dli_fname) {
+      setenv("STKJACK_LIBJACK", info.dli_fname, 0);
+   }
+   setenv("FAKEJACK_PERIOD", "64", 0);
+
+   // room for every period at the shortest period size
+   g_most_periods = (size_t)((seconds + 10) * 48000 / 32);
+   g_period_us = new float[g_most_periods];
+   g_late_us = new float[g_most_periods];
+
+   g_jack_client.run(&on_jack_process, NULL, &on_jack_shutdown, NULL);
+
+   // nothing is worth doing until there's a client
+   uint64_t gave_up = monotonic_ns() + 10000000000ULL;
+   while (!g_jack_client.active()) {
+      if (monotonic_ns() > gave_up) {
+	 fprintf(stderr, "soak: the client never came up\n");
+	 return 1;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   }
+
+   printf("soak: %g s, %d threads, %u frames at %u Hz to begin with\n",
+	  seconds, threads, (unsigned)g_jack_client.buffersize,
+	  (unsigned)g_jack_client.samplerate);
+
+   uint64_t until = monotonic_ns() + (uint64_t)(seconds * 1e9);
+   std::thread engine(engine_main);
+   std::thread server(server_main, until);
+   std::thread outages(outage_main, until);
+   std::vector<std::thread> patchers;
+   for (int i = 0; i < threads; i++) patchers.emplace_back(patcher_main, i, until);
+
+   /* periods stopping for good means something is stuck; a backtrace
+    * from every thread is more use than a test which never ends. the
+    * server being gone on purpose doesn't count. */
+   unsigned long last_periods = g_transport.periods;
+   uint64_t last_progress = monotonic_ns();
+   while (monotonic_ns() < until) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      unsigned long periods = g_transport.periods;
+      if (periods != last_periods || g_server_down) {
+	 last_periods = periods;
+	 last_progress = monotonic_ns();
+      } else if (monotonic_ns() - last_progress > 5000000000ULL) {
+	 fprintf(stderr, "soak: no periods for five seconds; stuck\n");
+	 abort();
+      }
+   }
+
+   server.join();
+   outages.join();
+   for (auto& patcher : patchers) patcher.join();
+   g_quitting = true;
+   engine.join();
+
+   size_t recorded = g_recorded.load(std::memory_order_acquire);
+   std::vector<float> period_us(g_period_us, g_period_us + recorded);
+   std::vector<float> late_us(g_late_us, g_late_us + recorded);
+
+   unsigned long xruns = fakejack_xruns();
+   unsigned long injected = g_injected_xruns;
+   printf("periods %lu, xruns %lu (%lu asked for), underruns %lu, stalls %lu (%.1f ms), "
+	  "period changes %lu, outages %lu\n",
+	  g_transport.periods.load(), xruns, injected, g_transport.underruns.load(),
+	  g_transport.stalls.load(), g_transport.stalled_ns / 1e6, g_resizes.load(),
+	  g_outages.load());
+   print_times("period", period_us, "us");
+   print_times("late by", late_us, "us");
+   print_times("add", g_times.add, "ms");
+   print_times("remove", g_times.remove, "ms");
+   print_times("rename", g_times.rename, "ms");
+   print_times("save", g_times.save, "ms");
+
+   // and out, with the client still up, as rack does
+   return 0;
+}
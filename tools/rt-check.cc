@@ -0,0 +1,250 @@
+/* the realtime safety checker; see src/rt-check.hh. glibc only.
+ *
+ * every function here stands in for libc's own, so it has to be linked
+ * ahead of libc or preloaded. each one notes a violation if the calling
+ * thread is marked realtime, then passes the call on. the first few of
+ * each kind are reported on stderr with a backtrace; after that they are
+ * only counted, and the counts are printed at exit.
+ *
+ * a lock is only a violation if it would have waited: an uncontended
+ * lock is a couple of atomics, but a contended one is a trip to the
+ * kernel for as long as somebody else likes. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+extern "C" {
+   // glibc's allocator under its own names, so we need no dlsym for it
+   void* __libc_malloc(size_t size);
+   void* __libc_calloc(size_t count, size_t size);
+   void* __libc_realloc(void* ptr, size_t size);
+   void __libc_free(void* ptr);
+}
+
+namespace {
+   enum kind {
+      MALLOC, CALLOC, REALLOC, FREE,
+      MUTEX_LOCK, COND_WAIT, COND_TIMEDWAIT, COND_CLOCKWAIT,
+      READ, WRITE, NANOSLEEP, CLOCK_NANOSLEEP, USLEEP, SCHED_YIELD,
+      MMAP, MUNMAP,
+      KINDS
+   };
+
+   const char* const kind_names[KINDS] = {
+      "malloc", "calloc", "realloc", "free",
+      "pthread_mutex_lock (contended)", "pthread_cond_wait", "pthread_cond_timedwait",
+      "pthread_cond_clockwait",
+      "read", "write", "nanosleep", "clock_nanosleep", "usleep", "sched_yield",
+      "mmap", "munmap",
+   };
+
+   // reported in full before we only count them
+   const unsigned long REPORTED = 8;
+
+   std::atomic<unsigned long> counts[KINDS];
+
+   /* initial-exec, as the general dynamic model may allocate the first
+    * time a thread touches it, which would bring it straight back here */
+   __thread int rt_depth __attribute__((tls_model("initial-exec")));
+   __thread int rt_paused __attribute__((tls_model("initial-exec")));
+   __thread bool reporting __attribute__((tls_model("initial-exec")));
+
+   // straight to the kernel, so the report doesn't report itself
+   void say(const char* text, int length) {
+      syscall(SYS_write, 2, text, (size_t)length);
+   }
+
+   void violation(kind what) {
+      if (rt_depth == 0 || rt_paused > 0 || reporting) return;
+      reporting = true;
+
+      unsigned long n = counts[what].fetch_add(1, std::memory_order_relaxed);
+      if (n < REPORTED) {
+	 char line[128];
+	 int length = snprintf(line, sizeof(line), "rt-check: %s in the realtime thread%s\n",
+			       kind_names[what],
+			       n + 1 == REPORTED ? "; only counting these from now on" : "");
+	 say(line, length);
+
+	 void* frames[32];
+	 int depth = backtrace(frames, 32);
+	 // leave out ourselves and the function we stand in for
+	 if (depth > 2) backtrace_symbols_fd(frames + 2, depth - 2, 2);
+      }
+
+      reporting = false;
+   }
+
+   /* libc's own function, looked up the first time we need it. no
+    * function statics, as their guards may take a lock. */
+   template <typename F>
+   F next(std::atomic<void*>& slot, const char* name) {
+      void* f = slot.load(std::memory_order_relaxed);
+      if (!f) {
+	 f = dlsym(RTLD_NEXT, name);
+	 slot.store(f, std::memory_order_relaxed);
+      }
+      return reinterpret_cast<F>(f);
+   }
+
+   std::atomic<void*> real_mutex_lock;
+   std::atomic<void*> real_cond_wait;
+   std::atomic<void*> real_cond_timedwait;
+   std::atomic<void*> real_cond_clockwait;
+   std::atomic<void*> real_read;
+   std::atomic<void*> real_write;
+   std::atomic<void*> real_nanosleep;
+   std::atomic<void*> real_clock_nanosleep;
+   std::atomic<void*> real_usleep;
+   std::atomic<void*> real_sched_yield;
+   std::atomic<void*> real_mmap;
+   std::atomic<void*> real_munmap;
+
+   // the first backtrace loads libgcc, which is better done now than mid-report
+   __attribute__((constructor)) void warm_up() {
+      void* frames[2];
+      backtrace(frames, 2);
+   }
+
+   __attribute__((destructor)) void summary() {
+      for (int i = 0; i < KINDS; i++) {
+	 unsigned long n = counts[i].load(std::memory_order_relaxed);
+	 if (n == 0) continue;
+
+	 char line[128];
+	 int length = snprintf(line, sizeof(line), "rt-check: %lu x %s\n", n, kind_names[i]);
+	 say(line, length);
+      }
+   }
+}
+
+extern "C" {
+
+void stkjack_rt_enter(void) { rt_depth++; }
+void stkjack_rt_leave(void) { rt_depth--; }
+void stkjack_rt_pause(void) { rt_paused++; }
+void stkjack_rt_resume(void) { rt_paused--; }
+
+unsigned long stkjack_rt_violations(void) {
+   unsigned long total = 0;
+   for (int i = 0; i < KINDS; i++) total += counts[i].load(std::memory_order_relaxed);
+   return total;
+}
+
+void* malloc(size_t size) __THROW {
+   violation(MALLOC);
+   return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) __THROW {
+   violation(CALLOC);
+   return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) __THROW {
+   violation(REALLOC);
+   return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) __THROW {
+   if (ptr) violation(FREE);
+   __libc_free(ptr);
+}
+
+int pthread_mutex_lock(pthread_mutex_t* mutex) __THROWNL {
+   if (rt_depth > 0 && !reporting) {
+      if (pthread_mutex_trylock(mutex) == 0) return 0;
+      violation(MUTEX_LOCK);
+   }
+   return next<int (*)(pthread_mutex_t*)>(real_mutex_lock, "pthread_mutex_lock")(mutex);
+}
+
+int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+   violation(COND_WAIT);
+   return next<int (*)(pthread_cond_t*, pthread_mutex_t*)>
+      (real_cond_wait, "pthread_cond_wait")(cond, mutex);
+}
+
+int pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex,
+			   const struct timespec* abstime)
+{
+   violation(COND_TIMEDWAIT);
+   return next<int (*)(pthread_cond_t*, pthread_mutex_t*, const struct timespec*)>
+      (real_cond_timedwait, "pthread_cond_timedwait")(cond, mutex, abstime);
+}
+
+/* what libstdc++ waits with when the clock is a steady one, wait_for
+ * included. it came with glibc 2.30, so it is declared here for older
+ * headers and only ever looked up, never linked to; nothing built
+ * against an older glibc calls it anyway. */
+int pthread_cond_clockwait(pthread_cond_t* cond, pthread_mutex_t* mutex,
+			   clockid_t clock, const struct timespec* abstime)
+{
+   violation(COND_CLOCKWAIT);
+   auto real = next<int (*)(pthread_cond_t*, pthread_mutex_t*, clockid_t, const struct timespec*)>
+      (real_cond_clockwait, "pthread_cond_clockwait");
+   if (!real) return ENOSYS;
+   return real(cond, mutex, clock, abstime);
+}
+
+ssize_t read(int fd, void* buf, size_t count) {
+   violation(READ);
+   return next<ssize_t (*)(int, void*, size_t)>(real_read, "read")(fd, buf, count);
+}
+
+ssize_t write(int fd, const void* buf, size_t count) {
+   violation(WRITE);
+   return next<ssize_t (*)(int, const void*, size_t)>(real_write, "write")(fd, buf, count);
+}
+
+int nanosleep(const struct timespec* duration, struct timespec* remaining) {
+   violation(NANOSLEEP);
+   return next<int (*)(const struct timespec*, struct timespec*)>
+      (real_nanosleep, "nanosleep")(duration, remaining);
+}
+
+int clock_nanosleep(clockid_t clock, int flags, const struct timespec* duration,
+		    struct timespec* remaining)
+{
+   violation(CLOCK_NANOSLEEP);
+   return next<int (*)(clockid_t, int, const struct timespec*, struct timespec*)>
+      (real_clock_nanosleep, "clock_nanosleep")(clock, flags, duration, remaining);
+}
+
+int usleep(useconds_t usec) {
+   violation(USLEEP);
+   return next<int (*)(useconds_t)>(real_usleep, "usleep")(usec);
+}
+
+int sched_yield(void) __THROW {
+   violation(SCHED_YIELD);
+   return next<int (*)(void)>(real_sched_yield, "sched_yield")();
+}
+
+void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset) __THROW {
+   violation(MMAP);
+   return next<void* (*)(void*, size_t, int, int, int, off_t)>
+      (real_mmap, "mmap")(addr, length, prot, flags, fd, offset);
+}
+
+int munmap(void* addr, size_t length) __THROW {
+   violation(MUNMAP);
+   return next<int (*)(void*, size_t)>(real_munmap, "munmap")(addr, length);
+}
+
+}
@@ -0,0 +1,152 @@
+/* prints what every running rack publishes in /dev/shm (see
+ * src/metrics.hh) in prometheus' text format, e.g. for node_exporter's
+ * textfile collector or a scrape through inetd.
+ *
+ *   stkjack-metrics [file...]
+ *
+ * with no files, reads every /dev/shm/stkjack-* there is. */
+
+#define STKJACK_METRICS_READER
+#include "metrics.hh"
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// a consistent copy of `path`, or false if it isn't one of ours
+static bool read_metrics(const char* path, stkjack_metrics& out) {
+   int fd = open(path, O_RDONLY);
+   if (fd < 0) {
+      fprintf(stderr, "stkjack-metrics: %s: %s\n", path, strerror(errno));
+      return false;
+   }
+
+   // one still being made; past its end is a SIGBUS
+   struct stat st;
+   if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(stkjack_metrics)) {
+      close(fd);
+      return false;
+   }
+
+   void* mapped = mmap(NULL, sizeof(stkjack_metrics), PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (mapped == MAP_FAILED) {
+      fprintf(stderr, "stkjack-metrics: %s: %s\n", path, strerror(errno));
+      return false;
+   }
+
+   auto m = reinterpret_cast<const stkjack_metrics*>(mapped);
+   bool good = false;
+   if (m->magic == STKJACK_METRICS_MAGIC && m->version == STKJACK_METRICS_VERSION) {
+      // the writer is done in well under a millisecond, so this is plenty
+      for (int tries = 0; tries < 1000 && !good; tries++) {
+	 uint32_t before = m->sequence.load(std::memory_order_acquire);
+	 // the copy's own sequence is never looked at
+	 memcpy(static_cast<void*>(&out), m, sizeof(out));
+	 std::atomic_thread_fence(std::memory_order_acquire);
+	 uint32_t after = m->sequence.load(std::memory_order_relaxed);
+	 good = (before % 2) == 0 && before == after;
+	 if (!good) usleep(100);
+      }
+   }
+
+   munmap(mapped, sizeof(stkjack_metrics));
+   return good;
+}
+
+struct metric {
+   const char* name;
+   const char* type;
+   const char* help;
+   // false to leave the metric out for this rack
+   bool (*value)(const stkjack_metrics& m, double& v);
+};
+
+static const metric metrics[] = {
+   { "stkjack_xruns_total", "counter", "xruns reported by the JACK server",
+     [](const stkjack_metrics& m, double& v) { v = m.xruns; return true; } },
+   { "stkjack_periods_total", "counter", "JACK periods moved",
+     [](const stkjack_metrics& m, double& v) { v = m.periods; return true; } },
+   { "stkjack_underruns_total", "counter", "periods a module had no audio ready for",
+     [](const stkjack_metrics& m, double& v) { v = m.underruns; return true; } },
+   { "stkjack_stalls_total", "counter", "times Rack's engine waited on JACK",
+     [](const stkjack_metrics& m, double& v) { v = m.stalls; return true; } },
+   { "stkjack_stall_seconds_total", "counter", "time Rack's engine spent waiting on JACK",
+     [](const stkjack_metrics& m, double& v) { v = m.stalled_ns / 1e9; return true; } },
+   { "stkjack_jack_running", "gauge", "1 while the JACK client is running",
+     [](const stkjack_metrics& m, double& v) { v = m.jack_running; return true; } },
+   { "stkjack_buffer_size_frames", "gauge", "JACK period size",
+     [](const stkjack_metrics& m, double& v) { v = m.buffersize; return m.buffersize != 0; } },
+   { "stkjack_jack_sample_rate_hertz", "gauge", "JACK's sample rate",
+     [](const stkjack_metrics& m, double& v) { v = m.jack_rate; return m.jack_rate != 0; } },
+   { "stkjack_rack_sample_rate_hertz", "gauge", "Rack engine's sample rate",
+     [](const stkjack_metrics& m, double& v) { v = m.rack_rate; return m.rack_rate != 0; } },
+   { "stkjack_sample_rate_mismatch", "gauge", "1 if Rack and JACK run at different rates, so audio is resampled",
+     [](const stkjack_metrics& m, double& v) {
+	v = m.jack_rate != m.rack_rate;
+	return m.jack_rate != 0 && m.rack_rate != 0;
+     } },
+   { "stkjack_buffer_fill_frames", "gauge", "most frames any module had buffered at the last period",
+     [](const stkjack_metrics& m, double& v) { v = m.fill_frames; return true; } },
+   { "stkjack_callback_seconds", "gauge", "time the process callback takes, smoothed",
+     [](const stkjack_metrics& m, double& v) { v = m.callback_ns / 1e9; return true; } },
+   { "stkjack_callback_peak_seconds", "gauge", "longest recent process callback",
+     [](const stkjack_metrics& m, double& v) { v = m.callback_peak_ns / 1e9; return true; } },
+   { "stkjack_dsp_load_ratio", "gauge", "the JACK server's DSP load",
+     [](const stkjack_metrics& m, double& v) { v = m.dsp_load / 100.0; return m.dsp_load >= 0.f; } },
+   { "stkjack_jack_clock_drift_ppm", "gauge", "how much faster JACK's clock runs than the system's",
+     [](const stkjack_metrics& m, double& v) { v = m.jack_drift_ppm; return m.jack_clock_settled != 0; } },
+   { "stkjack_jack_clock_jitter_seconds", "gauge", "how far JACK periods start from where they should, rms",
+     [](const stkjack_metrics& m, double& v) { v = m.jack_jitter_us / 1e6; return m.jack_clock_settled != 0; } },
+   { "stkjack_last_update_timestamp_seconds", "gauge", "when Rack last updated these",
+     [](const stkjack_metrics& m, double& v) { v = m.updated_ms / 1e3; return true; } },
+};
+
+int main(int argc, char** argv) {
+   std::vector<std::string> paths;
+   for (int i = 1; i < argc; i++) paths.push_back(argv[i]);
+
+   if (paths.empty()) {
+      glob_t found;
+      if (glob(STKJACK_METRICS_PREFIX "*", 0, NULL, &found) == 0) {
+	 for (size_t i = 0; i < found.gl_pathc; i++) paths.push_back(found.gl_pathv[i]);
+      }
+      globfree(&found);
+   }
+
+   // read in place, as the atomic sequence keeps them from being copied
+   std::deque<stkjack_metrics> racks;
+   for (auto& path : paths) {
+      racks.emplace_back();
+      stkjack_metrics& m = racks.back();
+      if (!read_metrics(path.c_str(), m)) {
+	 racks.pop_back();
+	 continue;
+      }
+
+      // left behind by a rack that crashed
+      if (kill(m.pid, 0) != 0 && errno == ESRCH) racks.pop_back();
+   }
+
+   for (auto& metric : metrics) {
+      printf("# HELP %s %s\n", metric.name, metric.help);
+      printf("# TYPE %s %s\n", metric.name, metric.type);
+      for (auto& m : racks) {
+	 double v;
+	 if (metric.value(m, v)) printf("%s{pid=\"%u\"} %.15g\n", metric.name, m.pid, v);
+      }
+   }
+
+   return 0;
+}